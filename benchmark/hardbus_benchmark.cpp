@@ -0,0 +1,559 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Benchmarks the generated adaptors against a private dbus-daemon.
+//
+// usage: hardbus_benchmark [--output results.json]
+//
+// The benchmark starts `dbus-daemon --session` listening in a temporary
+// directory and runs the service in a child process (the same executable with
+// --server), so calls really go through the bus instead of the in-process
+// short-circuit.
+
+#include "hardbus.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+//! Heap allocations made by the process, to report allocations per call.
+//! malloc itself is replaced: Qt containers allocate with it, and operator new
+//! goes through it too
+static std::atomic<qint64> allocations{0};
+
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *p, std::size_t size);
+void __libc_free(void *p);
+
+void *malloc(std::size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, std::size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) noexcept
+{
+    __libc_free(p);
+}
+}
+
+struct Payload
+{
+    QString name;
+    QVector<double> values;
+};
+
+QDataStream &operator<<(QDataStream &stream, const Payload &v)
+{
+    return stream << v.name << v.values;
+}
+
+QDataStream &operator>>(QDataStream &stream, Payload &v)
+{
+    return stream >> v.name >> v.values;
+}
+
+struct Point
+{
+    int x;
+    int y;
+};
+
+namespace hardbus
+{
+template<>
+struct ProxyBinaryConverter<Payload> : DataStreamBinaryConverter<Payload>
+{};
+
+//! Appends into the reused buffer
+template<>
+struct ProxyStringConverter<Point>
+{
+    void ToString(const Point &v, QString &out)
+    {
+        Append(v.x, out);
+        out += QLatin1Char(',');
+        Append(v.y, out);
+    }
+    //! Appends the digits of \a v, without the temporary string of QString::number
+    static void Append(int v, QString &out)
+    {
+        char digits[12];
+        auto end = std::end(digits);
+        auto begin = end;
+        auto magnitude = v < 0 ? 0u - unsigned(v) : unsigned(v);
+        do {
+            *--begin = char('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (v < 0) {
+            *--begin = '-';
+        }
+        out += QLatin1String(begin, int(end - begin));
+    }
+    //! Parses both numbers in place, without the list of splitRef
+    Point FromString(const QString &v)
+    {
+        const auto comma = v.indexOf(QLatin1Char(','));
+        return {v.leftRef(comma).toInt(), v.midRef(comma + 1).toInt()};
+    }
+};
+} // namespace hardbus
+
+class IBench : public QObject
+{
+    Q_OBJECT
+public:
+    using QObject::QObject;
+
+    virtual void Ping() = 0;
+    virtual int Echo(int v) = 0;
+    virtual Payload Transform(Payload v) = 0;
+    virtual Point Move(Point v) = 0;
+    virtual int Sum(QList<int> values) = 0;
+    //! Emits Tick \a count times
+    virtual void Burst(int count) = 0;
+    virtual int Level() const = 0;
+
+signals:
+    void Tick(int seq);
+    void LevelChanged(int level);
+};
+
+class Bench : public IBench
+{
+    Q_OBJECT
+public:
+    void Ping() override {}
+    int Echo(int v) override { return v; }
+    Payload Transform(Payload v) override
+    {
+        v.name += QLatin1Char('!');
+        return v;
+    }
+    Point Move(Point v) override { return {v.x + 1, v.y + 1}; }
+    int Sum(QList<int> values) override { return std::accumulate(values.begin(), values.end(), 0); }
+    void Burst(int count) override
+    {
+        for (int i = 0; i < count; ++i) {
+            emit Tick(i);
+        }
+    }
+    int Level() const override { return 7; }
+};
+
+#define BENCH_SERVICE_API(FUNC, SIG, PROP) \
+    FUNC(void, Ping, ()) \
+    FUNC(int, Echo, (int)) \
+    FUNC(Payload, Transform, (Payload)) \
+    FUNC(Point, Move, (Point)) \
+    FUNC(int, Sum, (QList<int>)) \
+    FUNC(void, Burst, (int)) \
+    SIG(void, Tick, (int)) \
+    PROP(int, Level)
+
+HARDBUS_DEFINE_SERVICE_WITH_PROPERTIES(BenchDefinition,
+                                       IBench,
+                                       BENCH_SERVICE_API,
+                                       "com.hardbus.Benchmark",
+                                       "/com/hardbus/Benchmark",
+                                       "com.hardbus.Benchmark",
+                                       QDBusConnection::sessionBus())
+
+HARDBUS_DEFINE_SERVICE_IMPL(BenchDefinition)
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+qint64 ElapsedNs(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+QJsonObject Percentiles(std::vector<qint64> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double p) {
+        return double(samples[std::min(samples.size() - 1, size_t(p * samples.size()))]);
+    };
+    return {{QStringLiteral("samples"), double(samples.size())},
+            {QStringLiteral("p50_ns"), at(0.5)},
+            {QStringLiteral("p90_ns"), at(0.9)},
+            {QStringLiteral("p99_ns"), at(0.99)},
+            {QStringLiteral("max_ns"), double(samples.back())}};
+}
+
+template<class F>
+QJsonObject MeasureLatency(int iterations, F call)
+{
+    for (int i = 0; i < iterations / 10; ++i) {
+        call();
+    }
+    std::vector<qint64> samples;
+    samples.reserve(size_t(iterations));
+    for (int i = 0; i < iterations; ++i) {
+        const auto start = Clock::now();
+        call();
+        samples.push_back(ElapsedNs(start));
+    }
+    return Percentiles(std::move(samples));
+}
+
+//! Heap allocations per call of \a call
+template<class F>
+double MeasureAllocations(int iterations, F call)
+{
+    call();
+    const auto before = allocations.load();
+    for (int i = 0; i < iterations; ++i) {
+        call();
+    }
+    return double(allocations.load() - before) / iterations;
+}
+
+//! Calls per second with \a clients threads, each with its own access object
+QJsonObject MeasureThroughput(int clients, int calls_per_client)
+{
+    std::vector<std::thread> threads;
+    const auto start = Clock::now();
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([calls_per_client] {
+            std::unique_ptr<IBench> bench{BenchDefinition::CreateAndConnectService()};
+            for (int i = 0; i < calls_per_client; ++i) {
+                bench->Echo(i);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto seconds = ElapsedNs(start) / 1e9;
+    return {{QStringLiteral("clients"), clients},
+            {QStringLiteral("calls"), clients * calls_per_client},
+            {QStringLiteral("calls_per_second"), clients * calls_per_client / seconds}};
+}
+
+//! Calls per second with \a threads threads sharing access object \a bench
+QJsonObject MeasureSharedThroughput(IBench *bench, int threads_count, int calls_per_thread)
+{
+    std::vector<std::thread> threads;
+    const auto start = Clock::now();
+    for (int t = 0; t < threads_count; ++t) {
+        threads.emplace_back([bench, calls_per_thread] {
+            for (int i = 0; i < calls_per_thread; ++i) {
+                bench->Echo(i);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto seconds = ElapsedNs(start) / 1e9;
+    return {{QStringLiteral("threads"), threads_count},
+            {QStringLiteral("calls"), threads_count * calls_per_thread},
+            {QStringLiteral("calls_per_second"), threads_count * calls_per_thread / seconds}};
+}
+
+//! Signals delivered per second to \a subscribers access objects
+QJsonObject MeasureFanOut(IBench *bench, int subscribers, int signals_count)
+{
+    std::vector<std::unique_ptr<IBench>> accesses;
+    int received = 0;
+    const int expected = subscribers * signals_count;
+    QEventLoop loop;
+    for (int s = 0; s < subscribers; ++s) {
+        accesses.emplace_back(BenchDefinition::CreateAndConnectService());
+        QObject::connect(accesses.back().get(), &IBench::Tick, [&] {
+            if (++received == expected) {
+                loop.quit();
+            }
+        });
+    }
+    // let the bus apply the match rules before the burst
+    bench->Ping();
+
+    const auto start = Clock::now();
+    bench->Burst(signals_count);
+    QTimer::singleShot(30000, &loop, &QEventLoop::quit);
+    if (received < expected) {
+        loop.exec();
+    }
+    const auto seconds = ElapsedNs(start) / 1e9;
+    return {{QStringLiteral("subscribers"), subscribers},
+            {QStringLiteral("delivered"), received},
+            {QStringLiteral("expected"), expected},
+            {QStringLiteral("signals_per_second"), received / seconds}};
+}
+
+//! dbus-daemon running in a temporary directory for the lifetime of the object
+class PrivateBus
+{
+public:
+    ~PrivateBus()
+    {
+        daemon_.terminate();
+        daemon_.waitForFinished();
+    }
+
+    bool Start()
+    {
+        daemon_.start(QStringLiteral("dbus-daemon"),
+                      {QStringLiteral("--session"),
+                       QStringLiteral("--nofork"),
+                       QStringLiteral("--print-address"),
+                       QStringLiteral("--address=unix:tmpdir=") + dir_.path()});
+        if (!daemon_.waitForStarted() || !daemon_.waitForReadyRead()) {
+            qWarning() << "Cannot start dbus-daemon" << daemon_.errorString();
+            return false;
+        }
+        address_ = daemon_.readLine().trimmed();
+        return !address_.isEmpty();
+    }
+
+    QByteArray Address() const { return address_; }
+
+private:
+    QTemporaryDir dir_;
+    QProcess daemon_;
+    QByteArray address_;
+};
+
+//! Serves until the client closes its standard input, so a traffic log is complete.
+//! Calls are recorded to \a record_path, if set
+int RunServer(QCoreApplication &app, const QString &record_path)
+{
+    Bench bench;
+    hardbus::ExportOptions options;
+    if (!record_path.isEmpty()) {
+        options.recorder = std::make_shared<hardbus::TrafficRecorder>(record_path);
+    }
+    const auto start = Clock::now();
+    BenchDefinition::RegisterService(&bench, options);
+    const auto register_ns = ElapsedNs(start);
+
+    QSocketNotifier input_closed{0, QSocketNotifier::Read};
+    QObject::connect(&input_closed, &QSocketNotifier::activated, &app, &QCoreApplication::quit);
+
+    QTextStream out{stdout};
+    out << register_ns << '\n';
+    out.flush();
+    return app.exec();
+}
+
+bool StartServer(QProcess &server, const QString &program, const QStringList &args)
+{
+    server.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    server.start(program, args);
+    if (!server.waitForReadyRead(30000)) {
+        qWarning() << "Benchmark server did not start";
+        return false;
+    }
+    return true;
+}
+
+//! Records a mix of calls, then replays it as fast as possible against a new server
+QJsonObject MeasureReplay(const QString &program)
+{
+    QTemporaryDir dir;
+    const auto log = dir.filePath(QStringLiteral("traffic.log"));
+    QProcess recording_server;
+    if (!StartServer(recording_server, program, {QStringLiteral("--server"), QStringLiteral("--record"), log})) {
+        return {};
+    }
+    {
+        std::unique_ptr<IBench> bench{BenchDefinition::CreateAndConnectService()};
+        const Point point{1, 2};
+        const QList<int> values{1, 2, 3, 4};
+        for (int i = 0; i < 10000; ++i) {
+            bench->Ping();
+            bench->Echo(i);
+            bench->Move(point);
+            bench->Sum(values);
+        }
+    }
+    recording_server.closeWriteChannel();
+    recording_server.waitForFinished();
+
+    QProcess server;
+    if (!StartServer(server, program, {QStringLiteral("--server")})) {
+        return {};
+    }
+    hardbus::ReplayOptions options;
+    options.speed = 0;
+    const auto report = BenchDefinition::ReplayTraffic(log, options);
+    server.closeWriteChannel();
+    server.waitForFinished();
+    return report;
+}
+
+int RunClient(QCoreApplication &app, const QString &output)
+{
+    PrivateBus bus;
+    if (!bus.Start()) {
+        return 1;
+    }
+    qputenv("DBUS_SESSION_BUS_ADDRESS", bus.Address());
+
+    QProcess server;
+    if (!StartServer(server, app.applicationFilePath(), {QStringLiteral("--server")})) {
+        return 1;
+    }
+    const auto register_ns = server.readLine().trimmed().toLongLong();
+
+    QJsonObject results;
+    results[QStringLiteral("register_service_ns")] = double(register_ns);
+
+    std::unique_ptr<IBench> bench{BenchDefinition::CreateServiceInterface()};
+    const auto connect_start = Clock::now();
+    BenchDefinition::WaitAndConnectService(bench.get());
+    results[QStringLiteral("wait_and_connect_service_ns")] = double(ElapsedNs(connect_start));
+
+    Payload payload{QStringLiteral("payload"), QVector<double>(16 * 1024, 1.0)};
+    QJsonObject latency;
+    latency[QStringLiteral("void")] = MeasureLatency(10000, [&] { bench->Ping(); });
+    latency[QStringLiteral("scalar")] = MeasureLatency(10000, [&] { bench->Echo(42); });
+    latency[QStringLiteral("large_struct")] = MeasureLatency(1000, [&] { bench->Transform(payload); });
+    const QList<int> values{1, 2, 3, 4, 5, 6, 7, 8};
+    latency[QStringLiteral("container")] = MeasureLatency(10000, [&] { bench->Sum(values); });
+    latency[QStringLiteral("property")] = MeasureLatency(10000, [&] { bench->Level(); });
+    results[QStringLiteral("latency")] = latency;
+
+    using namespace hardbus::internal;
+    const Point point{1, 2};
+    const auto point_proxy = ToProxy(point);
+    const int scalar = 42;
+    QJsonObject allocations_per_op;
+    allocations_per_op[QStringLiteral("to_proxy_scalar")] = MeasureAllocations(10000, [&] {
+        const int &proxy = ToProxy(scalar);
+        Q_UNUSED(proxy);
+    });
+    allocations_per_op[QStringLiteral("to_proxy_string")] = MeasureAllocations(10000, [&] {
+        ToProxy(point);
+    });
+    allocations_per_op[QStringLiteral("from_proxy_string")] = MeasureAllocations(10000, [&] {
+        FromProxy<Point>(point_proxy);
+    });
+    allocations_per_op[QStringLiteral("call_scalar")] = MeasureAllocations(1000, [&] { bench->Echo(42); });
+    allocations_per_op[QStringLiteral("call_string")] = MeasureAllocations(1000, [&] { bench->Move(point); });
+    // the same calls written against Qt D-Bus directly, which allocates for the message and the reply
+    const auto raw_call = [](const char *method, const QVariant &arg) {
+        auto message = QDBusMessage::createMethodCall(QLatin1String(BenchDefinition::ServiceName()),
+                                                      QLatin1String(BenchDefinition::ServicePath()),
+                                                      QLatin1String(BenchDefinition::ServiceInterface()),
+                                                      QLatin1String(method));
+        message.setArguments({arg});
+        return BenchDefinition::Connection().call(message).arguments().value(0);
+    };
+    allocations_per_op[QStringLiteral("raw_call_scalar")] = MeasureAllocations(1000, [&] {
+        raw_call("Echo", 42).toInt();
+    });
+    allocations_per_op[QStringLiteral("raw_call_string")] = MeasureAllocations(1000, [&] {
+        raw_call("Move", QStringLiteral("1,2")).toString();
+    });
+    results[QStringLiteral("allocations_per_op")] = allocations_per_op;
+    for (const auto conversion : {"to_proxy_scalar", "to_proxy_string", "from_proxy_string"}) {
+        if (allocations_per_op[QLatin1String(conversion)].toDouble() > 0) {
+            qWarning() << "Conversion allocates:" << conversion;
+            return 1;
+        }
+    }
+    // allocations of all threads are counted, so allow for less than one per call of noise
+    for (const auto call : {"call_scalar", "call_string"}) {
+        const auto overhead = allocations_per_op[QLatin1String(call)].toDouble()
+                              - allocations_per_op[QStringLiteral("raw_") + QLatin1String(call)].toDouble();
+        if (overhead >= 0.5) {
+            qWarning() << "Call allocates more than Qt D-Bus alone:" << call << overhead;
+            return 1;
+        }
+    }
+
+    QJsonArray throughput;
+    for (int clients : {1, 8, 64}) {
+        throughput.append(MeasureThroughput(clients, 64000 / clients));
+    }
+    results[QStringLiteral("throughput")] = throughput;
+
+    QJsonArray shared_throughput;
+    for (int threads : {1, 8, 64}) {
+        shared_throughput.append(MeasureSharedThroughput(bench.get(), threads, 64000 / threads));
+    }
+    results[QStringLiteral("shared_throughput")] = shared_throughput;
+
+    QJsonArray fan_out;
+    for (int subscribers : {1, 8, 64}) {
+        fan_out.append(MeasureFanOut(bench.get(), subscribers, 1000));
+    }
+    results[QStringLiteral("signal_fan_out")] = fan_out;
+
+    server.closeWriteChannel();
+    server.waitForFinished();
+
+    results[QStringLiteral("replay")] = MeasureReplay(app.applicationFilePath());
+
+    const auto json = QJsonDocument{results}.toJson();
+    if (output.isEmpty()) {
+        QTextStream{stdout} << json;
+        return 0;
+    }
+    QFile file{output};
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write" << output;
+        return 1;
+    }
+    file.write(json);
+    return 0;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app{argc, argv};
+    const auto args = app.arguments();
+    if (args.contains(QStringLiteral("--server"))) {
+        const int record_index = args.indexOf(QStringLiteral("--record"));
+        return RunServer(app, record_index > 0 ? args.value(record_index + 1) : QString{});
+    }
+    const int output_index = args.indexOf(QStringLiteral("--output"));
+    return RunClient(app, output_index > 0 ? args.value(output_index + 1) : QString{});
+}
+
+#include "hardbus_benchmark.moc"
@@ -28,328 +28,4298 @@
 #include <QtCore>
 #include <QtDBus>
 
-#include <type_traits>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(HARDBUS_ENABLE_FD_TRANSFER) && defined(Q_OS_LINUX)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "boost/preprocessor.hpp"
 
-#include "wobjectdefs.h"
-#include "wobjectimpl.h"
+#include "wobjectdefs.h"
+#include "wobjectimpl.h"
+
+///////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// PUBLIC MACRO ////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+//! Defines service \a TAG from \a API, a macro taking FUNC and SIG
+#define HARDBUS_DEFINE_SERVICE(TAG, INTERFACE, API, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
+    HARDBUS_INTERNAL_DEFINE_SERVICE_(TAG, INTERFACE, (2, API), BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE)
+
+//! Defines service \a TAG from \a API, a macro taking FUNC, SIG and PROP
+#define HARDBUS_DEFINE_SERVICE_WITH_PROPERTIES(TAG, INTERFACE, API, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
+    HARDBUS_INTERNAL_DEFINE_SERVICE_(TAG, INTERFACE, (3, API), BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE)
+
+//! Defines main() of a tool replaying traffic logs against the service of \a TAG,
+//! e.g. `replay traffic.log --speed 10 --bus unix:path=/tmp/bus --output report.json`
+#define HARDBUS_DEFINE_REPLAY_MAIN(TAG) \
+    int main(int argc, char **argv) \
+    { \
+        QCoreApplication app{argc, argv}; \
+        return ::hardbus::RunTrafficReplay<TAG::TraitsFor##TAG>(app.arguments()); \
+    }
+
+#define HARDBUS_DEFINE_SERVICE_IMPL(TAG) \
+    W_OBJECT_IMPL(TAG::StatsAdaptorFor##TAG); \
+    W_OBJECT_IMPL(TAG::ExporAdaptorFor##TAG); \
+    W_OBJECT_IMPL(TAG::ImportAdaptorFor##TAG); \
+    W_OBJECT_IMPL(TAG::AccessFor##TAG);
+
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////// PUBLIC ///////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+namespace hardbus
+{
+/// Exceptions
+class Exception : public std::runtime_error
+{
+    using base = std::runtime_error;
+
+public:
+    using base::base;
+    Exception(const QString &what) : base{what.toStdString()} {}
+};
+
+//! Customization point. Defines how types are converted to string and back
+//! Must provide QString ToString(T) and T FromString() methods. ToString can be
+//! replaced by void ToString(const T &, QString &out) appending to a reused buffer
+template<class T, class = void>
+struct ProxyStringConverter;
+
+//! Customization point. Defines how types are converted to bytes and back
+//! Must provide QByteArray ToBinary(T) and T FromBinary(QByteArray) methods,
+//! or void ToBinary(const T &, QByteArray &out) appending to a reused buffer
+//! Sent as `ay` and preferred over ProxyStringConverter when both are defined
+template<class T, class = void>
+struct ProxyBinaryConverter;
+
+//! Ready-made ProxyBinaryConverter for types with QDataStream operators
+//! template<> struct ProxyBinaryConverter<CustomType> : DataStreamBinaryConverter<CustomType> {};
+template<class T>
+struct DataStreamBinaryConverter
+{
+    QByteArray ToBinary(const T &v)
+    {
+        QByteArray data;
+        ToBinary(v, data);
+        return data;
+    }
+
+    void ToBinary(const T &v, QByteArray &out)
+    {
+        QDataStream stream{&out, QIODevice::WriteOnly | QIODevice::Append};
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << v;
+    }
+
+    T FromBinary(const QByteArray &data)
+    {
+        T v{};
+        QDataStream stream{data};
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream >> v;
+        if (stream.status() != QDataStream::Ok) {
+            throw ::hardbus::Exception{"Cannot deserialize binary proxy value"};
+        }
+        return v;
+    }
+};
+
+namespace internal
+{
+template<class...>
+struct MakeVoid
+{
+    using type = void;
+};
+
+template<class... Ts>
+using VoidT = typename MakeVoid<Ts...>::type;
+
+template<class T, class = void>
+struct HasAppendToString : std::false_type
+{};
+
+template<class T>
+struct HasAppendToString<T,
+                         VoidT<decltype(std::declval<ProxyStringConverter<T> &>().ToString(
+                             std::declval<const T &>(), std::declval<QString &>()))>>
+    : std::true_type
+{};
+
+template<class T, class = void>
+struct HasAppendToBinary : std::false_type
+{};
+
+template<class T>
+struct HasAppendToBinary<T,
+                         VoidT<decltype(std::declval<ProxyBinaryConverter<T> &>().ToBinary(
+                             std::declval<const T &>(), std::declval<QByteArray &>()))>>
+    : std::true_type
+{};
+
+template<class T, class = void>
+struct HasBinaryConverter : HasAppendToBinary<T>
+{};
+
+template<class T>
+struct HasBinaryConverter<
+    T,
+    VoidT<decltype(std::declval<ProxyBinaryConverter<T> &>().ToBinary(std::declval<const T &>()))>>
+    : std::true_type
+{};
+
+template<class T, class = void>
+struct HasDBusArgumentOperators : std::false_type
+{};
+
+template<class T>
+struct HasDBusArgumentOperators<
+    T,
+    VoidT<decltype(std::declval<QDBusArgument &>() << std::declval<const T &>()),
+          decltype(std::declval<const QDBusArgument &>() >> std::declval<T &>())>>
+    : std::integral_constant<bool, std::is_class<T>::value && QMetaTypeId2<T>::Defined>
+{};
+} // namespace internal
+
+//! Detects types D-Bus marshals natively. Those are sent with their real
+//! D-Bus signature and never go through ProxyStringConverter.
+//! Custom types qualify when they are declared with Q_DECLARE_METATYPE and
+//! provide QDBusArgument streaming operators
+template<class T>
+struct IsDBusNative : internal::HasDBusArgumentOperators<T>
+{};
+
+template<> struct IsDBusNative<bool> : std::true_type {};
+template<> struct IsDBusNative<uchar> : std::true_type {};
+template<> struct IsDBusNative<short> : std::true_type {};
+template<> struct IsDBusNative<ushort> : std::true_type {};
+template<> struct IsDBusNative<int> : std::true_type {};
+template<> struct IsDBusNative<uint> : std::true_type {};
+template<> struct IsDBusNative<qlonglong> : std::true_type {};
+template<> struct IsDBusNative<qulonglong> : std::true_type {};
+template<> struct IsDBusNative<double> : std::true_type {};
+template<> struct IsDBusNative<QString> : std::true_type {};
+template<> struct IsDBusNative<QByteArray> : std::true_type {};
+template<> struct IsDBusNative<QStringList> : std::true_type {};
+template<> struct IsDBusNative<QDBusObjectPath> : std::true_type {};
+template<> struct IsDBusNative<QDBusSignature> : std::true_type {};
+template<> struct IsDBusNative<QDBusVariant> : std::true_type {};
+template<> struct IsDBusNative<QDBusUnixFileDescriptor> : std::true_type {};
+
+template<class T>
+struct IsDBusNative<QList<T>> : IsDBusNative<T>
+{};
+
+//! D-Bus dictionary keys must be basic types
+template<class K, class V>
+struct IsDBusNative<QMap<K, V>>
+    : std::integral_constant<bool,
+                             (std::is_arithmetic<K>::value || std::is_same<K, QString>::value)
+                                 && IsDBusNative<K>::value && IsDBusNative<V>::value>
+{};
+
+class TrafficRecorder;
+
+//! Optional features of an exported service
+struct ExportOptions
+{
+    //! Also listen on a private QDBusServer socket. Clients then talk to the
+    //! service directly, without the bus daemon in between
+    bool peer_to_peer = false;
+    //! Address the QDBusServer listens on
+    QString peer_address = QStringLiteral("unix:tmpdir=") + QDir::tempPath();
+    //! Run incoming calls on this pool and reply once they complete, so a slow
+    //! call does not block other clients. Calls to the same function run one
+    //! at a time unless it is marked `concurrent`. The implementation must be thread-safe
+    QThreadPool *dispatch_pool = nullptr;
+    //! Also export the `<interface>.Stats` interface reporting the metrics of the service
+    bool stats = false;
+    //! Writes every incoming call to a traffic log, see ReplayTraffic
+    std::shared_ptr<TrafficRecorder> recorder;
+};
+
+//! Counters of the client-side result cache of an access object
+struct CacheStats
+{
+    quint64 hits = 0;
+    quint64 misses = 0;
+    //! Entries dropped because they expired or were invalidated by a signal
+    quint64 evictions = 0;
+};
+
+//! Log-linear histogram of durations in nanoseconds with 8 buckets per power of two,
+//! so any recorded value is reported with at most 12.5% error. Recording is lock-free
+class Histogram
+{
+public:
+    void Record(qint64 ns)
+    {
+        buckets_[BucketOf(quint64(qMax<qint64>(ns, 0)))].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    quint64 Count() const { return count_.load(std::memory_order_relaxed); }
+
+    //! Upper bound of the bucket holding the \a p quantile (0..1)
+    qint64 Percentile(double p) const
+    {
+        const auto target = quint64(std::ceil(p * Count()));
+        quint64 seen = 0;
+        for (int i = 0; i < int(buckets_.size()); ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target && seen > 0) {
+                return qint64(LowerBound(i + 1) - 1);
+            }
+        }
+        return 0;
+    }
+
+    void Reset()
+    {
+        for (auto &bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+    }
+
+    QJsonObject ToJson() const
+    {
+        return {{QStringLiteral("count"), double(Count())},
+                {QStringLiteral("p50_ns"), double(Percentile(0.5))},
+                {QStringLiteral("p90_ns"), double(Percentile(0.9))},
+                {QStringLiteral("p99_ns"), double(Percentile(0.99))},
+                {QStringLiteral("p999_ns"), double(Percentile(0.999))}};
+    }
+
+private:
+    // values up to 2^40 ns (~18 minutes), larger ones go to the last bucket
+    enum { max_exponent = 40 };
+
+    static int BucketOf(quint64 v)
+    {
+        if (v < 8) {
+            return int(v);
+        }
+        const int e = 63 - qCountLeadingZeroBits(v);
+        return qMin((e - 2) * 8 + int((v >> (e - 3)) & 7), (max_exponent - 1) * 8 - 1);
+    }
+
+    static quint64 LowerBound(int bucket)
+    {
+        if (bucket < 8) {
+            return quint64(bucket);
+        }
+        return quint64(8 + bucket % 8) << (bucket / 8 - 1);
+    }
+
+    std::array<std::atomic<quint64>, (max_exponent - 1) * 8> buckets_{};
+    std::atomic<quint64> count_{0};
+};
+
+//! Counters of one function or signal on one side of the bus
+struct MethodMetrics
+{
+    std::atomic<quint64> calls{0};
+    std::atomic<quint64> errors{0};
+    //! Payload received and sent, estimated from the proxy values
+    std::atomic<quint64> bytes_in{0};
+    std::atomic<quint64> bytes_out{0};
+    //! Time spent converting values to and from proxies
+    Histogram serialization;
+    //! Time spent in the implementation (export side)
+    Histogram implementation;
+    //! Time of a blocking call without local serialization (access side)
+    Histogram round_trip;
+    //! Size of the values of `compressed` functions before and after compression
+    std::atomic<quint64> uncompressed_bytes{0};
+    std::atomic<quint64> compressed_bytes{0};
+    //! Time spent compressing and decompressing, part of serialization
+    Histogram compression;
+
+    void Reset()
+    {
+        calls = 0;
+        errors = 0;
+        bytes_in = 0;
+        bytes_out = 0;
+        uncompressed_bytes = 0;
+        compressed_bytes = 0;
+        serialization.Reset();
+        implementation.Reset();
+        round_trip.Reset();
+        compression.Reset();
+    }
+
+    QJsonObject ToJson() const
+    {
+        const double compressed = double(compressed_bytes);
+        return {{QStringLiteral("calls"), double(calls)},
+                {QStringLiteral("errors"), double(errors)},
+                {QStringLiteral("bytes_in"), double(bytes_in)},
+                {QStringLiteral("bytes_out"), double(bytes_out)},
+                {QStringLiteral("uncompressed_bytes"), double(uncompressed_bytes)},
+                {QStringLiteral("compressed_bytes"), compressed},
+                {QStringLiteral("compression_ratio"), compressed > 0 ? double(uncompressed_bytes) / compressed : 0.0},
+                {QStringLiteral("serialization"), serialization.ToJson()},
+                {QStringLiteral("implementation"), implementation.ToJson()},
+                {QStringLiteral("round_trip"), round_trip.ToJson()},
+                {QStringLiteral("compression"), compression.ToJson()}};
+    }
+};
+
+//! Metrics of all functions and signals of a service, in this process
+class ServiceMetrics
+{
+public:
+    //! Calls served and signals emitted by an exported service
+    MethodMetrics &Export(const QString &name) { return Get(export_, name); }
+    //! Calls made and signals received by access objects
+    MethodMetrics &Import(const QString &name) { return Get(import_, name); }
+
+    void Reset()
+    {
+        QMutexLocker lock{&mutex_};
+        for (auto &m : export_) {
+            m.second->Reset();
+        }
+        for (auto &m : import_) {
+            m.second->Reset();
+        }
+    }
+
+    QJsonObject ToJson() const
+    {
+        QMutexLocker lock{&mutex_};
+        return {{QStringLiteral("export"), ToJson(export_)}, {QStringLiteral("import"), ToJson(import_)}};
+    }
+
+private:
+    using Methods = std::map<QString, std::unique_ptr<MethodMetrics>>;
+
+    MethodMetrics &Get(Methods &methods, const QString &name)
+    {
+        QMutexLocker lock{&mutex_};
+        auto &m = methods[name];
+        if (!m) {
+            m.reset(new MethodMetrics);
+        }
+        return *m;
+    }
+
+    static QJsonObject ToJson(const Methods &methods)
+    {
+        QJsonObject json;
+        for (auto &m : methods) {
+            json.insert(m.first, m.second->ToJson());
+        }
+        return json;
+    }
+
+    mutable QMutex mutex_;
+    Methods export_;
+    Methods import_;
+};
+
+namespace internal
+{
+template<class Traits>
+ServiceMetrics &MetricsFor()
+{
+    static ServiceMetrics metrics;
+    return metrics;
+}
+} // namespace internal
+
+namespace internal
+{
+inline std::atomic<int> &LargeTransferThreshold()
+{
+    static std::atomic<int> threshold{64 * 1024};
+    return threshold;
+}
+} // namespace internal
+
+//! Binary payloads of at least \a bytes are passed as a sealed memfd instead of inline.
+//! Takes effect when hardbus is built with HARDBUS_ENABLE_FD_TRANSFER
+inline void SetLargeTransferThreshold(int bytes)
+{
+    internal::LargeTransferThreshold() = bytes;
+}
+
+namespace internal
+{
+inline std::atomic<int> &CompressionThreshold()
+{
+    static std::atomic<int> threshold{1024};
+    return threshold;
+}
+} // namespace internal
+
+//! String and binary values of `compressed` functions are compressed with
+//! qCompress once they reach \a bytes. Smaller ones are sent as they are
+inline void SetCompressionThreshold(int bytes)
+{
+    internal::CompressionThreshold() = bytes;
+}
+
+namespace internal
+{
+//! Opens a direct connection to the peer address published by the service.
+//! Returns \a bus when there is none or it is unreachable. Every call opens a
+//! connection of its own, so its caller may disconnect it without cutting off
+//! the other access objects talking to the same peer
+inline QDBusConnection ConnectPeer(const QString &service_name,
+                                   const QString &object_path,
+                                   const QString &interface,
+                                   const QDBusConnection &bus)
+{
+    auto call = QDBusMessage::createMethodCall(service_name,
+                                               object_path,
+                                               interface,
+                                               QStringLiteral("hardbus_peer_address"));
+    QDBusReply<QString> address = bus.call(call);
+    if (!address.isValid() || address.value().isEmpty()) {
+        return bus;
+    }
+    static std::atomic<quint64> connections{0};
+    const auto name = QStringLiteral("hardbus-peer:%1:%2").arg(address.value()).arg(++connections);
+    auto peer = QDBusConnection::connectToPeer(address.value(), name);
+    if (!peer.isConnected()) {
+        qWarning() << "Cannot connect to peer" << address.value() << peer.lastError().message();
+        QDBusConnection::disconnectFromPeer(name);
+        return bus;
+    }
+    return peer;
+}
+
+//! Services exported by this process. Lets access objects bypass the bus
+template<class Traits>
+class LocalServices
+{
+    using Interface = typename Traits::interface;
+
+public:
+    static void Set(Interface *service)
+    {
+        QMutexLocker lock{&Mutex()};
+        Service() = service;
+    }
+
+    static void Reset(Interface *service)
+    {
+        QMutexLocker lock{&Mutex()};
+        if (Service() == service) {
+            Service() = nullptr;
+        }
+    }
+
+    static Interface *Get()
+    {
+        QMutexLocker lock{&Mutex()};
+        return Service().data();
+    }
+
+private:
+    static QMutex &Mutex()
+    {
+        static QMutex mutex;
+        return mutex;
+    }
+
+    static QPointer<Interface> &Service()
+    {
+        static QPointer<Interface> service;
+        return service;
+    }
+};
+
+template<class Traits>
+bool ConnectAccess(typename Traits::interface *service)
+{
+    auto service_name = Traits::dbus_service_name;
+    auto casted = qobject_cast<typename Traits::access *>(service);
+    if (!casted) {
+        qWarning() << "Wrong instance to connect to" << service_name;
+        return false;
+    }
+    if (casted->RemoteInterface() || casted->local_interface_) {
+        qWarning() << "Can't reconnect previously connected service " << service_name;
+        return false;
+    }
+    if (auto local = LocalServices<Traits>::Get()) {
+        casted->ConnectLocal(local);
+        return true;
+    }
+    casted->ConnectRemote();
+    return true;
+}
+} // namespace internal
+
+//! Exports \a service to the worlds
+template<class Traits>
+void RegisterService(typename Traits::interface *service, Traits = {}, ExportOptions options = {})
+{
+    new typename Traits::dbus_export(service, options);
+}
+
+//! Creates a service access object
+template<class Traits>
+auto CreateServiceInterface(Traits = {}, QObject *parent = nullptr) -> typename Traits::interface *
+{
+    return new typename Traits::access{parent};
+}
+
+//Checks if service
+inline bool IsServiceRegistered(const QString &service_name, const QDBusConnection &connection)
+{
+    bool is_registered = connection.interface()->isServiceRegistered(service_name);
+    return is_registered;
+}
+
+template<class Traits>
+bool IsServiceRegistered(Traits = {})
+{
+    return IsServiceRegistered(Traits::dbus_service_name, Traits::connection_type());
+}
+
+//! Waits until \a service_name appears on \a connection, at most \a timeout_ms
+//! milliseconds (-1 waits forever). Returns false on timeout. The watcher lives in a
+//! thread of its own, so the caller blocks without running a nested event loop that
+//! would deliver its other events in the middle of the wait
+inline bool WaitForServiceRegistration(const QString &service_name,
+                                       const QDBusConnection &connection,
+                                       int timeout_ms = -1)
+{
+    QMutex mutex;
+    QWaitCondition registration;
+    bool registered = false;
+    QThread thread;
+    QObject context;
+    context.moveToThread(&thread);
+    thread.start();
+    std::unique_ptr<QDBusServiceWatcher> watcher;
+    // watch before checking, so a registration in between is not missed
+    QMetaObject::invokeMethod(
+        &context,
+        [&] {
+            watcher.reset(new QDBusServiceWatcher{service_name, connection, QDBusServiceWatcher::WatchForRegistration});
+            QObject::connect(watcher.get(), &QDBusServiceWatcher::serviceRegistered, [&] {
+                QMutexLocker lock{&mutex};
+                registered = true;
+                registration.wakeAll();
+            });
+        },
+        Qt::BlockingQueuedConnection);
+    const bool already = IsServiceRegistered(service_name, connection);
+    {
+        QMutexLocker lock{&mutex};
+        registered = registered || already;
+        QElapsedTimer elapsed;
+        elapsed.start();
+        while (!registered && (timeout_ms < 0 || !elapsed.hasExpired(timeout_ms))) {
+            registration.wait(&mutex,
+                              timeout_ms < 0 ? ULONG_MAX
+                                             : static_cast<unsigned long>(qMax<qint64>(1, timeout_ms - elapsed.elapsed())));
+        }
+    }
+    QMetaObject::invokeMethod(&context, [&] { watcher.reset(); }, Qt::BlockingQueuedConnection);
+    thread.quit();
+    thread.wait();
+    return registered;
+}
+
+template<class Traits>
+bool WaitForServiceRegistration(Traits = {}, int timeout_ms = -1)
+{
+    if (internal::LocalServices<Traits>::Get()) {
+        return true;
+    }
+    return WaitForServiceRegistration(Traits::dbus_service_name, Traits::connection_type(), timeout_ms);
+}
+
+//! Connects access object \a service. Services exported by the same process
+//! are called directly, without the bus and without serialization
+template<class Traits>
+bool ConnectService(typename Traits::interface *service, Traits = {})
+{
+    auto service_name = Traits::dbus_service_name;
+    if (!internal::LocalServices<Traits>::Get() && !IsServiceRegistered<Traits>()) {
+        qWarning() << "Service" << service_name << "is not registered";
+        return false;
+    }
+    return internal::ConnectAccess<Traits>(service);
+}
+
+template<class Traits>
+bool WaitAndConnectService(typename Traits::interface *service, Traits traits = {}, int timeout_ms = -1)
+{
+    return WaitForServiceRegistration(traits, timeout_ms) && ConnectService(service, traits);
+}
+
+//! Connects access object \a service once the service appears, without blocking.
+//! \a callback gets the result in the thread of \a service, at the latest
+//! after \a timeout_ms milliseconds (-1 waits forever)
+template<class Traits>
+void ConnectServiceAsync(typename Traits::interface *service,
+                         int timeout_ms,
+                         std::function<void(bool)> callback,
+                         Traits = {})
+{
+    auto connection = Traits::connection_type();
+    auto watcher = new QDBusServiceWatcher(Traits::dbus_service_name,
+                                           connection,
+                                           QDBusServiceWatcher::WatchForRegistration,
+                                           service);
+    auto finished = std::make_shared<bool>(false);
+    auto finish = [service, watcher, callback, finished](bool registered) {
+        if (*finished) {
+            return;
+        }
+        *finished = true;
+        watcher->deleteLater();
+        callback(registered && internal::ConnectAccess<Traits>(service));
+    };
+    QObject::connect(watcher, &QDBusServiceWatcher::serviceRegistered, service, [finish] { finish(true); });
+    if (timeout_ms >= 0) {
+        QTimer::singleShot(timeout_ms, watcher, [finish] { finish(false); });
+    }
+    if (internal::LocalServices<Traits>::Get() || IsServiceRegistered(Traits::dbus_service_name, connection)) {
+        QMetaObject::invokeMethod(watcher, [finish] { finish(true); }, Qt::QueuedConnection);
+    }
+}
+
+} // namespace hardbus
+
+///////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////// PRIVATE //////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////
+
+#ifdef HARDBUS_ENABLE_FD_TRANSFER
+namespace hardbus
+{
+/// Large payload transfer
+namespace internal
+{
+//! Whether the values converted to proxies in this thread go out over a connection
+//! that can pass file descriptors. The connections of a process differ, so this
+//! follows the connection of the call or signal being converted, and is off outside
+class FdTransfer
+{
+public:
+    static bool Allowed() { return Current(); }
+
+    //! Follows \a connection while the values of a call or signal are converted
+    class Scope
+    {
+    public:
+        explicit Scope(const QDBusConnection &connection) : Scope{CanPass(connection)} {}
+        //! Off when there is no \a remote to call
+        explicit Scope(const QDBusAbstractInterface *remote) : Scope{remote && CanPass(remote->connection())} {}
+        ~Scope() { Current() = previous_; }
+
+    private:
+        explicit Scope(bool allowed) : previous_{Current()} { Current() = allowed; }
+
+        bool previous_;
+    };
+
+private:
+    static bool CanPass(const QDBusConnection &connection)
+    {
+#ifdef Q_OS_LINUX
+        return connection.connectionCapabilities() & QDBusConnection::UnixFileDescriptorPassing;
+#else
+        Q_UNUSED(connection);
+        return false;
+#endif
+    }
+
+    static bool &Current()
+    {
+        static thread_local bool current = false;
+        return current;
+    }
+};
+
+#ifdef Q_OS_LINUX
+//! Copies \a data into a memfd sealed against any further modification
+inline QDBusUnixFileDescriptor CreateSealedMemfd(const QByteArray &data)
+{
+    int fd = ::memfd_create("hardbus", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return {};
+    }
+    const char *pos = data.constData();
+    qint64 left = data.size();
+    while (left > 0) {
+        auto written = ::write(fd, pos, static_cast<size_t>(left));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            ::close(fd);
+            return {};
+        }
+        pos += written;
+        left -= written;
+    }
+    if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        ::close(fd);
+        return {};
+    }
+    QDBusUnixFileDescriptor result{fd};
+    ::close(fd);
+    return result;
+}
+
+//! Maps a sealed memfd read-only. Returns a raw QByteArray over the mapping,
+//! kept alive by \a mapping
+inline QByteArray MapSealedMemfd(const QDBusUnixFileDescriptor &fd,
+                                 std::shared_ptr<const char> &mapping)
+{
+    const int required_seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+    auto seals = ::fcntl(fd.fileDescriptor(), F_GET_SEALS);
+    if (seals < 0 || (seals & required_seals) != required_seals) {
+        qWarning() << "Rejecting large payload: memfd is not sealed";
+        return {};
+    }
+    struct stat info;
+    if (::fstat(fd.fileDescriptor(), &info) < 0 || info.st_size == 0) {
+        return {};
+    }
+    auto size = static_cast<size_t>(info.st_size);
+    auto address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.fileDescriptor(), 0);
+    if (address == MAP_FAILED) {
+        qWarning() << "Cannot map large payload";
+        return {};
+    }
+    mapping.reset(static_cast<const char *>(address),
+                  [size](const char *p) { ::munmap(const_cast<char *>(p), size); });
+    return QByteArray::fromRawData(mapping.get(), static_cast<int>(size));
+}
+#endif
+
+//! Binary proxy value. Travels as a variant holding either the bytes (`ay`)
+//! or, above the large transfer threshold, a sealed memfd (`h`). Whether the
+//! memfd may be used is taken from the FdTransfer scope it is made in, since
+//! QtDBus marshals replies after the scope of the export call is left
+class LargePayload
+{
+public:
+    LargePayload() = default;
+    LargePayload(QByteArray data) : data_{std::move(data)} {}
+
+    //! Bytes of the payload. Received memfds are not copied: the array
+    //! refers to the mapping and is valid while this payload is alive
+    const QByteArray &Data() const { return data_; }
+
+    friend QDBusArgument &operator<<(QDBusArgument &arg, const LargePayload &v)
+    {
+#ifdef Q_OS_LINUX
+        if (v.data_.size() >= LargeTransferThreshold() && v.pass_fd_) {
+            auto fd = CreateSealedMemfd(v.data_);
+            if (fd.isValid()) {
+                arg << QDBusVariant{QVariant::fromValue(fd)};
+                return arg;
+            }
+        }
+#endif
+        arg << QDBusVariant{QVariant{v.data_}};
+        return arg;
+    }
+
+    friend const QDBusArgument &operator>>(const QDBusArgument &arg, LargePayload &v)
+    {
+        QDBusVariant variant;
+        arg >> variant;
+        auto value = variant.variant();
+        v.mapping_.reset();
+#ifdef Q_OS_LINUX
+        if (value.userType() == qMetaTypeId<QDBusUnixFileDescriptor>()) {
+            v.data_ = MapSealedMemfd(value.value<QDBusUnixFileDescriptor>(), v.mapping_);
+            return arg;
+        }
+#endif
+        v.data_ = value.toByteArray();
+        return arg;
+    }
+
+private:
+    QByteArray data_;
+    std::shared_ptr<const char> mapping_;
+    bool pass_fd_{FdTransfer::Allowed()};
+};
+
+using BinaryProxy = LargePayload;
+} // namespace internal
+} // namespace hardbus
+
+Q_DECLARE_METATYPE(hardbus::internal::LargePayload)
+#else
+namespace hardbus
+{
+namespace internal
+{
+//! File descriptors are never passed
+class FdTransfer
+{
+public:
+    static bool Allowed() { return false; }
+
+    class Scope
+    {
+    public:
+        explicit Scope(const QDBusConnection &) {}
+        explicit Scope(const QDBusAbstractInterface *) {}
+    };
+};
+
+using BinaryProxy = QByteArray;
+} // namespace internal
+} // namespace hardbus
+#endif
+
+namespace hardbus
+{
+/// Streams
+namespace internal
+{
+template<class T>
+using StreamWriter = std::function<bool(const T &)>;
+
+template<class T>
+using StreamProducer = std::function<void(const StreamWriter<T> &)>;
+
+//! Where a stream reads its values from
+template<class T>
+class StreamSource
+{
+public:
+    virtual ~StreamSource() = default;
+    //! Reads the next value, returns false at the end of the stream
+    virtual bool Next(T &value) = 0;
+};
+
+//! Runs \a producer, which may not throw out of its thread
+template<class T>
+void RunStreamProducer(const StreamProducer<T> &producer, const StreamWriter<T> &writer)
+{
+    try {
+        producer(writer);
+    } catch (const std::exception &e) {
+        qWarning() << "Stream producer failed:" << e.what();
+    }
+}
+
+//! Values passed from the producer thread to the reader. The producer
+//! waits while \a capacity values are pending
+template<class T>
+class StreamChannel
+{
+public:
+    explicit StreamChannel(int capacity) : capacity_{capacity} {}
+
+    //! Returns false once the reader is gone
+    bool Push(const T &value)
+    {
+        QMutexLocker lock{&mutex_};
+        while (!abandoned_ && int(values_.size()) >= capacity_) {
+            changed_.wait(&mutex_);
+        }
+        if (abandoned_) {
+            return false;
+        }
+        values_.push_back(value);
+        changed_.wakeAll();
+        return true;
+    }
+
+    bool Pop(T &value)
+    {
+        QMutexLocker lock{&mutex_};
+        while (values_.empty() && !closed_) {
+            changed_.wait(&mutex_);
+        }
+        if (values_.empty()) {
+            return false;
+        }
+        value = std::move(values_.front());
+        values_.pop_front();
+        changed_.wakeAll();
+        return true;
+    }
+
+    void Close()
+    {
+        QMutexLocker lock{&mutex_};
+        closed_ = true;
+        changed_.wakeAll();
+    }
+
+    void Abandon()
+    {
+        QMutexLocker lock{&mutex_};
+        abandoned_ = true;
+        values_.clear();
+        changed_.wakeAll();
+    }
+
+private:
+    QMutex mutex_;
+    QWaitCondition changed_;
+    std::deque<T> values_;
+    int capacity_;
+    bool closed_ = false;
+    bool abandoned_ = false;
+};
+
+//! Runs the producer of a stream served in-process, without serialization
+template<class T>
+class ChannelStreamSource : public StreamSource<T>
+{
+public:
+    explicit ChannelStreamSource(StreamProducer<T> producer)
+        : channel_{std::make_shared<StreamChannel<T>>(64)}
+    {
+        auto channel = channel_;
+        thread_ = std::thread{[channel, producer] {
+            RunStreamProducer<T>(producer, [&](const T &value) { return channel->Push(value); });
+            channel->Close();
+        }};
+    }
+
+    //! The producer learns that the reader is gone at its next value
+    ~ChannelStreamSource() override
+    {
+        channel_->Abandon();
+        thread_.join();
+    }
+
+    bool Next(T &value) override { return channel_->Pop(value); }
+
+private:
+    std::shared_ptr<StreamChannel<T>> channel_;
+    std::thread thread_;
+};
+
+//! Longest stream record accepted from the bus. Longer lengths are taken for a corrupt stream
+constexpr quint32 max_stream_record_size = 64 * 1024 * 1024;
+
+//! Size of the record starting at \a header, checked against max_stream_record_size
+inline int StreamRecordSize(const char *header)
+{
+    const auto size = qFromBigEndian<quint32>(header);
+    if (size > max_stream_record_size) {
+        throw ::hardbus::Exception{"Stream record too large"};
+    }
+    return int(size);
+}
+
+//! Appends \a value to \a out as a big-endian 32-bit length and QDataStream data
+template<class T>
+void AppendStreamRecord(QByteArray &out, const T &value)
+{
+    const int start = out.size();
+    out.append(4, '\0');
+    {
+        QDataStream stream{&out, QIODevice::WriteOnly | QIODevice::Append};
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << value;
+    }
+    qToBigEndian(quint32(out.size() - start - 4), out.data() + start);
+}
+
+template<class T>
+void ReadStreamRecord(const QByteArray &record, T &value)
+{
+    QDataStream stream{record};
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> value;
+    if (stream.status() != QDataStream::Ok) {
+        throw ::hardbus::Exception{"Cannot deserialize stream record"};
+    }
+}
+
+//! Stream received inline, with all its records
+template<class T>
+class BytesStreamSource : public StreamSource<T>
+{
+public:
+    explicit BytesStreamSource(QByteArray records) : records_{std::move(records)} {}
+
+    bool Next(T &value) override
+    {
+        if (records_.size() - pos_ < 4) {
+            return false;
+        }
+        const auto size = StreamRecordSize(records_.constData() + pos_);
+        if (records_.size() - pos_ - 4 < size) {
+            throw ::hardbus::Exception{"Truncated stream record"};
+        }
+        ReadStreamRecord(QByteArray::fromRawData(records_.constData() + pos_ + 4, size), value);
+        pos_ += 4 + size;
+        return true;
+    }
+
+private:
+    QByteArray records_;
+    int pos_ = 0;
+};
+
+#if defined(HARDBUS_ENABLE_FD_TRANSFER) && defined(Q_OS_LINUX)
+//! Writes \a size bytes to socket \a fd. False once the reader has closed it
+inline bool SendAll(int fd, const char *data, qint64 size)
+{
+    while (size > 0) {
+        auto sent = ::send(fd, data, static_cast<size_t>(size), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+//! Reads \a size bytes from \a fd. False at the end of the stream
+inline bool ReadAll(int fd, char *data, qint64 size)
+{
+    while (size > 0) {
+        auto received = ::read(fd, data, static_cast<size_t>(size));
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+//! Producer threads of the streams sent by an export adaptor. Destroying it
+//! shuts their sockets down, so the producers stop at their next value, and
+//! joins them
+class StreamThreads
+{
+public:
+    StreamThreads() = default;
+    StreamThreads(const StreamThreads &) = delete;
+    StreamThreads &operator=(const StreamThreads &) = delete;
+
+    ~StreamThreads()
+    {
+        QMutexLocker lock{&mutex_};
+        for (auto &producer : producers_) {
+            if (producer->socket >= 0) {
+                ::shutdown(producer->socket, SHUT_RDWR);
+            }
+        }
+        auto producers = std::move(producers_);
+        lock.unlock();
+        for (auto &producer : producers) {
+            producer->thread.join();
+        }
+    }
+
+    //! Runs \a write in a thread of its own, then closes \a socket
+    void Start(int socket, std::function<void()> write)
+    {
+        Reap();
+        auto producer = std::make_shared<Producer>();
+        producer->socket = socket;
+        // the thread cannot finish, and be reaped, before it is stored
+        QMutexLocker lock{&mutex_};
+        producer->thread = std::thread{[this, producer, write] {
+            write();
+            QMutexLocker lock{&mutex_};
+            ::close(producer->socket);
+            producer->socket = -1;
+        }};
+        producers_.push_back(std::move(producer));
+    }
+
+    //! Threads of the export call running in this thread, if any
+    static StreamThreads *&Current()
+    {
+        static thread_local StreamThreads *current = nullptr;
+        return current;
+    }
+
+    //! Makes \a threads current while the export call runs
+    class Scope
+    {
+    public:
+        explicit Scope(StreamThreads &threads) : previous_{Current()} { Current() = &threads; }
+        ~Scope() { Current() = previous_; }
+
+    private:
+        StreamThreads *previous_;
+    };
+
+private:
+    struct Producer
+    {
+        std::thread thread;
+        int socket = -1;
+    };
+
+    //! Joins the threads that are done
+    void Reap()
+    {
+        std::vector<std::shared_ptr<Producer>> finished;
+        {
+            QMutexLocker lock{&mutex_};
+            for (auto it = producers_.begin(); it != producers_.end();) {
+                if ((*it)->socket < 0) {
+                    finished.push_back(std::move(*it));
+                    it = producers_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto &producer : finished) {
+            producer->thread.join();
+        }
+    }
+
+    QMutex mutex_;
+    std::vector<std::shared_ptr<Producer>> producers_;
+};
+
+//! Stream whose records arrive through a socket while they are produced
+template<class T>
+class SocketStreamSource : public StreamSource<T>
+{
+public:
+    explicit SocketStreamSource(QDBusUnixFileDescriptor fd) : fd_{std::move(fd)} {}
+
+    bool Next(T &value) override
+    {
+        char header[4];
+        if (!ReadAll(fd_.fileDescriptor(), header, sizeof(header))) {
+            return false;
+        }
+        record_.resize(StreamRecordSize(header));
+        if (!ReadAll(fd_.fileDescriptor(), record_.data(), record_.size())) {
+            throw ::hardbus::Exception{"Truncated stream record"};
+        }
+        ReadStreamRecord(record_, value);
+        return true;
+    }
+
+private:
+    QDBusUnixFileDescriptor fd_;
+    QByteArray record_;
+};
+#else
+//! Streams are sent inline without file descriptor passing, so no threads are started
+class StreamThreads
+{
+public:
+    class Scope
+    {
+    public:
+        explicit Scope(StreamThreads &) {}
+    };
+};
+#endif
+
+//! Proxy of a stream. Travels as a variant holding either the reading end of
+//! a socket the records are written to (`h`), or all records (`ay`)
+class StreamPayload
+{
+public:
+    StreamPayload() = default;
+    explicit StreamPayload(QByteArray records) : records_{std::move(records)} {}
+    explicit StreamPayload(QDBusUnixFileDescriptor fd) : fd_{std::move(fd)} {}
+
+    const QByteArray &Records() const { return records_; }
+    const QDBusUnixFileDescriptor &Fd() const { return fd_; }
+
+    friend QDBusArgument &operator<<(QDBusArgument &arg, const StreamPayload &v)
+    {
+        if (v.fd_.isValid()) {
+            arg << QDBusVariant{QVariant::fromValue(v.fd_)};
+        } else {
+            arg << QDBusVariant{QVariant{v.records_}};
+        }
+        return arg;
+    }
+
+    friend const QDBusArgument &operator>>(const QDBusArgument &arg, StreamPayload &v)
+    {
+        QDBusVariant variant;
+        arg >> variant;
+        auto value = variant.variant();
+        if (value.userType() == qMetaTypeId<QDBusUnixFileDescriptor>()) {
+            v.fd_ = value.value<QDBusUnixFileDescriptor>();
+            v.records_.clear();
+        } else {
+            v.fd_ = {};
+            v.records_ = value.toByteArray();
+        }
+        return arg;
+    }
+
+private:
+    QByteArray records_;
+    QDBusUnixFileDescriptor fd_;
+};
+
+//! Starts sending the values of \a producer. They are written to a socket by
+//! a thread of the current export call when file descriptors can be passed,
+//! and collected into the payload otherwise
+template<class T>
+StreamPayload SendStream(StreamProducer<T> producer)
+{
+#if defined(HARDBUS_ENABLE_FD_TRANSFER) && defined(Q_OS_LINUX)
+    int fds[2];
+    auto threads = StreamThreads::Current();
+    if (threads && FdTransfer::Allowed() && ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0) {
+        QDBusUnixFileDescriptor reader{fds[1]};
+        ::close(fds[1]);
+        const int writer = fds[0];
+        threads->Start(writer, [writer, producer] {
+            QByteArray record;
+            RunStreamProducer<T>(producer, [&](const T &value) {
+                record.reserve(record.capacity());
+                record.resize(0);
+                AppendStreamRecord(record, value);
+                return SendAll(writer, record.constData(), record.size());
+            });
+        });
+        return StreamPayload{reader};
+    }
+#endif
+    QByteArray records;
+    producer([&](const T &value) {
+        AppendStreamRecord(records, value);
+        return true;
+    });
+    return StreamPayload{records};
+}
+
+template<class T>
+std::unique_ptr<StreamSource<T>> ReceiveStream(const StreamPayload &payload)
+{
+    if (!payload.Fd().isValid()) {
+        return std::unique_ptr<StreamSource<T>>{new BytesStreamSource<T>{payload.Records()}};
+    }
+#if defined(HARDBUS_ENABLE_FD_TRANSFER) && defined(Q_OS_LINUX)
+    return std::unique_ptr<StreamSource<T>>{new SocketStreamSource<T>{payload.Fd()}};
+#else
+    throw ::hardbus::Exception{"Streams passed as file descriptors need HARDBUS_ENABLE_FD_TRANSFER"};
+#endif
+}
+
+template<class T>
+struct StreamState
+{
+    StreamProducer<T> producer;
+    std::unique_ptr<StreamSource<T>> source;
+};
+} // namespace internal
+
+//! Values of a function result produced one by one, e.g. the records of a large
+//! query. The producer runs in a thread of its own once the stream is read or
+//! returned over the bus, and waits while the reader lags behind, so neither
+//! side holds the whole result. Over the bus the values are length-prefixed
+//! QDataStream records, so \a T needs QDataStream operators. They go through a
+//! socket passed with the reply when hardbus is built with
+//! HARDBUS_ENABLE_FD_TRANSFER, and are all sent inline in the reply otherwise.
+//! Copies share their position
+template<class T>
+class Stream
+{
+public:
+    using value_type = T;
+    //! Returns false once the reader is gone, so the producer can stop
+    using Writer = internal::StreamWriter<T>;
+    using Producer = internal::StreamProducer<T>;
+
+    //! Empty stream
+    Stream() = default;
+    Stream(Producer producer) { state_->producer = std::move(producer); }
+    explicit Stream(std::unique_ptr<internal::StreamSource<T>> source) { state_->source = std::move(source); }
+
+    //! Reads the next value into \a value, waiting for it to be produced.
+    //! Returns false at the end of the stream
+    bool Next(T &value) const
+    {
+        if (!state_->source && state_->producer) {
+            state_->source.reset(new internal::ChannelStreamSource<T>{std::move(state_->producer)});
+            state_->producer = nullptr;
+        }
+        return state_->source && state_->source->Next(value);
+    }
+
+    //! Producer of the remaining values, for sending the stream elsewhere
+    Producer TakeProducer() const
+    {
+        if (state_->producer) {
+            auto producer = std::move(state_->producer);
+            state_->producer = nullptr;
+            return producer;
+        }
+        auto state = state_;
+        return [state](const Writer &write) {
+            T value;
+            while (state->source && state->source->Next(value) && write(value)) {
+            }
+        };
+    }
+
+private:
+    std::shared_ptr<internal::StreamState<T>> state_{std::make_shared<internal::StreamState<T>>()};
+};
+
+template<class T>
+struct IsStream : std::false_type
+{};
+
+template<class T>
+struct IsStream<Stream<T>> : std::true_type
+{};
+} // namespace hardbus
+
+Q_DECLARE_METATYPE(hardbus::internal::StreamPayload)
+
+namespace hardbus
+{
+/// Compression
+namespace internal
+{
+//! Proxy of string and binary values of `compressed` functions. Travels as
+//! `(yay)`: whether the data is compressed with qCompress, and the UTF-8
+//! string or the bytes
+struct CompressedPayload
+{
+    bool compressed = false;
+    QByteArray data;
+
+    friend QDBusArgument &operator<<(QDBusArgument &arg, const CompressedPayload &v)
+    {
+        arg.beginStructure();
+        arg << uchar(v.compressed) << v.data;
+        arg.endStructure();
+        return arg;
+    }
+
+    friend const QDBusArgument &operator>>(const QDBusArgument &arg, CompressedPayload &v)
+    {
+        uchar compressed = 0;
+        arg.beginStructure();
+        arg >> compressed >> v.data;
+        arg.endStructure();
+        v.compressed = compressed != 0;
+        return arg;
+    }
+};
+} // namespace internal
+} // namespace hardbus
+
+Q_DECLARE_METATYPE(hardbus::internal::CompressedPayload)
+
+namespace hardbus
+{
+/// Proxy conversion
+namespace internal
+{
+//! Thread-local buffer, emptied but keeping its memory. It is only copied
+//! when the previous value made from it is still alive
+template<class Buffer>
+Buffer &ReusableBuffer()
+{
+    static thread_local Buffer buffer;
+    buffer.reserve(buffer.capacity());
+    buffer.resize(0);
+    return buffer;
+}
+
+template<class T>
+QString ToProxyString(const T &v, std::false_type /*append*/)
+{
+    return ::hardbus::ProxyStringConverter<T>{}.ToString(v);
+}
+
+template<class T>
+QString ToProxyString(const T &v, std::true_type /*append*/)
+{
+    auto &buffer = ReusableBuffer<QString>();
+    ::hardbus::ProxyStringConverter<T>{}.ToString(v, buffer);
+    return buffer;
+}
+
+template<class T>
+QString ToProxyString(const T &v)
+{
+    return ToProxyString(v, HasAppendToString<std::decay_t<T>>{});
+}
+
+template<class T>
+T FromProxyString(const QString &v)
+{
+    return ProxyStringConverter<std::decay_t<T>>{}.FromString(v);
+}
+
+template<class T>
+QByteArray ToProxyBinary(const T &v, std::false_type /*append*/)
+{
+    return ::hardbus::ProxyBinaryConverter<T>{}.ToBinary(v);
+}
+
+template<class T>
+QByteArray ToProxyBinary(const T &v, std::true_type /*append*/)
+{
+    auto &buffer = ReusableBuffer<QByteArray>();
+    ::hardbus::ProxyBinaryConverter<T>{}.ToBinary(v, buffer);
+    return buffer;
+}
+
+template<class T>
+QByteArray ToProxyBinary(const T &v)
+{
+    return ToProxyBinary(v, HasAppendToBinary<std::decay_t<T>>{});
+}
+
+template<class T>
+T FromProxyBinary(const QByteArray &v)
+{
+    return ProxyBinaryConverter<std::decay_t<T>>{}.FromBinary(v);
+}
+
+//! How a type travels over D-Bus
+enum class ProxyKind { Native, Binary, String, Stream };
+
+template<class T>
+using ProxyKindOf = std::integral_constant<ProxyKind,
+                                           IsStream<T>::value
+                                               ? ProxyKind::Stream
+                                               : HasBinaryConverter<T>::value
+                                                     ? ProxyKind::Binary
+                                                     : IsDBusNative<T>::value ? ProxyKind::Native
+                                                                              : ProxyKind::String>;
+
+//! Type actually sent over D-Bus for \a T
+template<class T, ProxyKind = ProxyKindOf<T>::value>
+struct ProxyTypeFor
+{
+    using type = QString;
+};
+
+template<class T>
+struct ProxyTypeFor<T, ProxyKind::Native>
+{
+    using type = T;
+};
+
+template<class T>
+struct ProxyTypeFor<T, ProxyKind::Binary>
+{
+    using type = BinaryProxy;
+};
+
+template<class T>
+struct ProxyTypeFor<T, ProxyKind::Stream>
+{
+    using type = StreamPayload;
+};
+
+template<class T>
+using ProxyType = typename ProxyTypeFor<std::decay_t<T>>::type;
+
+//! Values `compressed` functions compress: those sent as strings or bytes
+template<class T>
+struct IsCompressible : std::integral_constant<bool,
+                                               ProxyKindOf<std::decay_t<T>>::value == ProxyKind::String
+                                                   || ProxyKindOf<std::decay_t<T>>::value == ProxyKind::Binary>
+{};
+
+template<>
+struct IsCompressible<void> : std::false_type
+{};
+
+//! Type sent over D-Bus for \a T by a function, `compressed` or not
+template<class T, bool COMPRESSED>
+using MethodProxyType = std::conditional_t<COMPRESSED && IsCompressible<T>::value, CompressedPayload, ProxyType<T>>;
+
+template<class T>
+const T &ToProxyImpl(const T &v, std::integral_constant<ProxyKind, ProxyKind::Native>)
+{
+    return v;
+}
+
+template<class T>
+BinaryProxy ToProxyImpl(const T &v, std::integral_constant<ProxyKind, ProxyKind::Binary>)
+{
+    return ToProxyBinary(v);
+}
+
+template<class T>
+QString ToProxyImpl(const T &v, std::integral_constant<ProxyKind, ProxyKind::String>)
+{
+    return ToProxyString(v);
+}
+
+template<class T>
+StreamPayload ToProxyImpl(const T &v, std::integral_constant<ProxyKind, ProxyKind::Stream>)
+{
+    return SendStream<typename T::value_type>(v.TakeProducer());
+}
+
+//! Native values are passed on by reference
+template<class T>
+decltype(auto) ToProxy(const T &v)
+{
+    return ToProxyImpl(v, ProxyKindOf<std::decay_t<T>>{});
+}
+
+template<class T>
+const T &FromProxyImpl(const T &v, std::integral_constant<ProxyKind, ProxyKind::Native>)
+{
+    return v;
+}
+
+inline const QByteArray &BinaryProxyData(const QByteArray &v)
+{
+    return v;
+}
+
+#ifdef HARDBUS_ENABLE_FD_TRANSFER
+inline const QByteArray &BinaryProxyData(const LargePayload &v)
+{
+    return v.Data();
+}
+#endif
+
+template<class T>
+T FromProxyImpl(const BinaryProxy &v, std::integral_constant<ProxyKind, ProxyKind::Binary>)
+{
+    return FromProxyBinary<T>(BinaryProxyData(v));
+}
+
+template<class T>
+T FromProxyImpl(const QString &v, std::integral_constant<ProxyKind, ProxyKind::String>)
+{
+    return FromProxyString<T>(v);
+}
+
+template<class T>
+T FromProxyImpl(const StreamPayload &v, std::integral_constant<ProxyKind, ProxyKind::Stream>)
+{
+    return T{ReceiveStream<typename T::value_type>(v)};
+}
+
+template<class T>
+T FromProxy(const ProxyType<T> &v)
+{
+    return FromProxyImpl<std::decay_t<T>>(v, ProxyKindOf<std::decay_t<T>>{});
+}
+
+inline qint64 ProxyByteSize(const QString &v)
+{
+    return v.size();
+}
+
+inline qint64 ProxyByteSize(const QByteArray &v)
+{
+    return v.size();
+}
+
+#ifdef HARDBUS_ENABLE_FD_TRANSFER
+inline qint64 ProxyByteSize(const LargePayload &v)
+{
+    return v.Data().size();
+}
+#endif
+
+inline qint64 ProxyByteSize(const CompressedPayload &v)
+{
+    return v.data.size();
+}
+
+inline qint64 ProxyByteSize(const StreamPayload &v)
+{
+    return v.Records().size();
+}
+
+template<class T>
+qint64 ProxyByteSize(const T &)
+{
+    return sizeof(T);
+}
+
+template<class T>
+qint64 ProxyByteSize(const QList<T> &v)
+{
+    qint64 size = 0;
+    for (const auto &e : v) {
+        size += ProxyByteSize(e);
+    }
+    return size;
+}
+
+template<class K, class V>
+qint64 ProxyByteSize(const QMap<K, V> &v)
+{
+    qint64 size = 0;
+    for (auto it = v.begin(); it != v.end(); ++it) {
+        size += ProxyByteSize(it.key()) + ProxyByteSize(it.value());
+    }
+    return size;
+}
+
+//! Collects serialization time and payload size of the call running in this thread
+class CallMeasurement
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CallMeasurement(MethodMetrics &metrics, Histogram *timing)
+        : metrics_(metrics), timing_{timing}, previous_{Current()}, start_{Clock::now()}
+    {
+        Current() = this;
+    }
+    CallMeasurement(const CallMeasurement &) = delete;
+    CallMeasurement &operator=(const CallMeasurement &) = delete;
+
+    ~CallMeasurement()
+    {
+        Current() = previous_;
+        const auto total = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_);
+        metrics_.calls.fetch_add(1, std::memory_order_relaxed);
+        if (failed_) {
+            metrics_.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        metrics_.bytes_in.fetch_add(quint64(bytes_in_), std::memory_order_relaxed);
+        metrics_.bytes_out.fetch_add(quint64(bytes_out_), std::memory_order_relaxed);
+        metrics_.serialization.Record(serialization_ns_);
+        if (timing_) {
+            timing_->Record(total.count() - serialization_ns_);
+        }
+    }
+
+    static CallMeasurement *&Current()
+    {
+        static thread_local CallMeasurement *current = nullptr;
+        return current;
+    }
+
+    void Failed() { failed_ = true; }
+
+    void AddIn(qint64 bytes, Clock::time_point start)
+    {
+        bytes_in_ += bytes;
+        AddSerialization(start);
+    }
+
+    void AddOut(qint64 bytes, Clock::time_point start)
+    {
+        bytes_out_ += bytes;
+        AddSerialization(start);
+    }
+
+    //! \a uncompressed bytes were compressed to \a compressed bytes, or back, since \a start
+    void AddCompression(qint64 uncompressed, qint64 compressed, Clock::time_point start)
+    {
+        metrics_.uncompressed_bytes.fetch_add(quint64(uncompressed), std::memory_order_relaxed);
+        metrics_.compressed_bytes.fetch_add(quint64(compressed), std::memory_order_relaxed);
+        metrics_.compression.Record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+
+private:
+    void AddSerialization(Clock::time_point start)
+    {
+        serialization_ns_
+            += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    MethodMetrics &metrics_;
+    Histogram *timing_;
+    CallMeasurement *previous_;
+    Clock::time_point start_;
+    qint64 serialization_ns_ = 0;
+    qint64 bytes_in_ = 0;
+    qint64 bytes_out_ = 0;
+    bool failed_ = false;
+};
+
+//! Runs \a f recording it in \a metrics. \a timing gets the time without serialization
+template<class F>
+decltype(auto) Measure(MethodMetrics &metrics, Histogram *timing, F &&f)
+{
+    CallMeasurement measurement{metrics, timing};
+    try {
+        return f();
+    } catch (...) {
+        measurement.Failed();
+        throw;
+    }
+}
+
+//! Counts a failure of asynchronous call \a call in \a metrics once its reply
+//! arrives. The reply is watched in the thread of \a context
+inline void CountErrorWhenFinished(const QDBusPendingCall &call, MethodMetrics &metrics, QObject *context)
+{
+    if (call.isFinished()) {
+        if (call.isError()) {
+            metrics.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    auto m = &metrics;
+    QMetaObject::invokeMethod(
+        context,
+        [call, m] {
+            auto watcher = new QDBusPendingCallWatcher{call};
+            QObject::connect(watcher, &QDBusPendingCallWatcher::finished, watcher, [m, watcher] {
+                if (watcher->isError()) {
+                    m->errors.fetch_add(1, std::memory_order_relaxed);
+                }
+                watcher->deleteLater();
+            });
+        },
+        Qt::QueuedConnection);
+}
+
+//! Marks the call being measured in this thread as failed
+inline void MeasuredCallFailed()
+{
+    if (auto measurement = CallMeasurement::Current()) {
+        measurement->Failed();
+    }
+}
+
+//! Compresses \a data once it reaches the compression threshold
+inline CompressedPayload Compress(QByteArray data)
+{
+    CompressedPayload payload;
+    if (data.isEmpty() || data.size() < CompressionThreshold()) {
+        payload.data = std::move(data);
+        return payload;
+    }
+    const auto start = CallMeasurement::Clock::now();
+    payload.data = qCompress(data);
+    payload.compressed = true;
+    if (auto measurement = CallMeasurement::Current()) {
+        measurement->AddCompression(data.size(), payload.data.size(), start);
+    }
+    return payload;
+}
+
+inline QByteArray Decompress(const CompressedPayload &payload)
+{
+    if (!payload.compressed) {
+        return payload.data;
+    }
+    const auto start = CallMeasurement::Clock::now();
+    auto data = qUncompress(payload.data);
+    if (data.isEmpty()) {
+        throw ::hardbus::Exception{"Cannot decompress payload"};
+    }
+    if (auto measurement = CallMeasurement::Current()) {
+        measurement->AddCompression(data.size(), payload.data.size(), start);
+    }
+    return data;
+}
+
+template<class T>
+CompressedPayload ToCompressedProxy(const T &v, std::integral_constant<ProxyKind, ProxyKind::String>)
+{
+    return Compress(ToProxyString(v).toUtf8());
+}
+
+template<class T>
+CompressedPayload ToCompressedProxy(const T &v, std::integral_constant<ProxyKind, ProxyKind::Binary>)
+{
+    return Compress(ToProxyBinary(v));
+}
+
+template<class T>
+T FromCompressedProxy(const QByteArray &data, std::integral_constant<ProxyKind, ProxyKind::String>)
+{
+    return FromProxyString<T>(QString::fromUtf8(data));
+}
+
+template<class T>
+T FromCompressedProxy(const QByteArray &data, std::integral_constant<ProxyKind, ProxyKind::Binary>)
+{
+    return FromProxyBinary<T>(data);
+}
+
+//! Values of `compressed` functions
+template<class T>
+T FromProxy(const CompressedPayload &v)
+{
+    return FromCompressedProxy<std::decay_t<T>>(Decompress(v), ProxyKindOf<std::decay_t<T>>{});
+}
+
+//! Holds a received proxy value until the target type is known
+template<class P>
+struct FromProxyValue
+{
+    template<class T>
+    operator T() const
+    {
+        auto measurement = CallMeasurement::Current();
+        if (!measurement) {
+            return FromProxy<T>(v_);
+        }
+        const auto start = CallMeasurement::Clock::now();
+        T v = FromProxy<T>(v_);
+        measurement->AddIn(ProxyByteSize(v_), start);
+        return v;
+    }
+
+    P v_;
+};
+
+//! Refers to proxies that outlive the conversion and takes temporary ones
+struct FromProxyConverter
+{
+    template<class P>
+    FromProxyValue<const P &> operator()(const P &v) const
+    {
+        return {v};
+    }
+
+    template<class P, class = std::enable_if_t<!std::is_lvalue_reference<P>::value>>
+    FromProxyValue<P> operator()(P &&v) const
+    {
+        return {std::move(v)};
+    }
+};
+
+struct ToProxyConverter
+{
+    template<class T>
+    decltype(auto) operator()(const T &v) const
+    {
+        auto measurement = CallMeasurement::Current();
+        if (!measurement) {
+            return ToProxy(v);
+        }
+        const auto start = CallMeasurement::Clock::now();
+        decltype(auto) proxy = ToProxy(v);
+        measurement->AddOut(ProxyByteSize(proxy), start);
+        return proxy;
+    }
+};
+
+//! Converts the values of `compressed` functions
+struct CompressingToProxyConverter
+{
+    template<class T>
+    decltype(auto) operator()(const T &v) const
+    {
+        return Convert(v, IsCompressible<T>{});
+    }
+
+private:
+    template<class T>
+    static decltype(auto) Convert(const T &v, std::false_type /*compressible*/)
+    {
+        return ToProxyConverter{}(v);
+    }
+
+    template<class T>
+    static CompressedPayload Convert(const T &v, std::true_type /*compressible*/)
+    {
+        auto measurement = CallMeasurement::Current();
+        const auto start = CallMeasurement::Clock::now();
+        auto payload = ToCompressedProxy(v, ProxyKindOf<std::decay_t<T>>{});
+        if (measurement) {
+            measurement->AddOut(ProxyByteSize(payload), start);
+        }
+        return payload;
+    }
+};
+
+template<bool COMPRESSED>
+using MethodToProxyConverter = std::conditional_t<COMPRESSED, CompressingToProxyConverter, ToProxyConverter>;
+
+//! Extracts \a P from a value received inside a variant. Values QtDBus
+//! does not know how to demarshal are kept as QDBusArgument
+template<class P>
+P ProxyFromVariant(const QVariant &v)
+{
+    if (v.userType() == qMetaTypeId<QDBusArgument>()) {
+        return qdbus_cast<P>(v.value<QDBusArgument>());
+    }
+    return v.value<P>();
+}
+
+//! Reads reply value \a v, sent as CompressedPayload by `compressed` functions
+template<class R>
+R FromReplyVariant(const QVariant &v, std::true_type /*compressible*/)
+{
+    if (v.userType() == qMetaTypeId<QDBusArgument>()
+        && v.value<QDBusArgument>().currentSignature() == QLatin1String("(yay)")) {
+        return FromProxy<R>(ProxyFromVariant<CompressedPayload>(v));
+    }
+    return FromProxy<R>(ProxyFromVariant<ProxyType<R>>(v));
+}
+
+template<class R>
+R FromReplyVariant(const QVariant &v, std::false_type /*compressible*/)
+{
+    return FromProxy<R>(ProxyFromVariant<ProxyType<R>>(v));
+}
+
+//! Registers D-Bus marshalling of proxy types unknown to QtDBus (e.g. QList<int>)
+template<class P>
+bool RegisterProxyType()
+{
+    static const bool registered = [] {
+        if (qMetaTypeId<P>() >= QMetaType::User) {
+            qDBusRegisterMetaType<P>();
+        }
+        return true;
+    }();
+    return registered;
+}
+
+template<class T, class R, class... Args>
+void RegisterProxyTypesOf(R (T::*)(Args...))
+{
+    (void) std::initializer_list<bool>{RegisterProxyType<ProxyType<R>>(),
+                                       RegisterProxyType<ProxyType<Args>>()...};
+}
+
+template<class T, class... Args>
+void RegisterProxyTypesOf(void (T::*)(Args...))
+{
+    (void) std::initializer_list<bool>{true, RegisterProxyType<ProxyType<Args>>()...};
+}
+} // namespace internal
+
+/// Macro helpers
+namespace internal
+{
+// void overload
+template<class CONV, class F>
+auto CreaeteFromReturnValueImpl(const F &f)
+    -> std::enable_if_t<std::is_same<void, std::result_of_t<F()>>::value, ProxyType<void>>
+{
+    f();
+    return {};
+}
+
+//non void overload
+template<class CONV, class F>
+auto CreaeteFromReturnValueImpl(const F &f)
+    -> std::enable_if_t<!std::is_same<void, std::result_of_t<F()>>::value,
+                        std::decay_t<decltype(CONV{}(f()))>>
+{
+    return CONV{}(f());
+}
+
+//! Converts return value of \a f with \a CONV.
+//! Creates default contructed proxy value if \a f returns void
+template<class CONV, class F>
+auto CreaeteFromReturnValue(const F &f)
+{
+    return CreaeteFromReturnValueImpl<CONV>(f);
+}
+
+template<class RET, class ARG, class F, class T, class... Args>
+auto ProxyCallHelper(F f, T *obj, Args &... proxy_args)
+{
+    auto wrapped = [&] { return (obj->*f)(ARG{}(proxy_args)...); };
+    return CreaeteFromReturnValue<RET>(wrapped);
+}
+
+template<class TO, class... Args>
+auto ProxyCallHelper1(Args &&... args)
+{
+    return ProxyCallHelper<TO, FromProxyConverter>(std::forward<Args>(args)...);
+}
+
+template<class TO, class F, class T, class... Args>
+auto ProxyCallHelper2(F &&f, T *obj, Args &&... args)
+{
+    if (!obj)
+        throw ::hardbus::Exception{"service not registered"};
+    return ProxyCallHelper<FromProxyConverter, TO>(f, obj, std::forward<Args>(args)...);
+}
+
+//! Method call addressed to \a interface, made once per generated method and
+//! copied for each call instead of building the header strings every time
+inline QDBusMessage MethodCallTemplate(const QDBusAbstractInterface *interface, const QString &func_name)
+{
+    return QDBusMessage::createMethodCall(interface->service(),
+                                          interface->path(),
+                                          interface->interface(),
+                                          func_name);
+}
+
+template<class... Args>
+QDBusMessage MethodCall(const QDBusMessage &message_template, Args &&... proxy_args)
+{
+    auto message = message_template;
+    message.setArguments({QVariant::fromValue(std::forward<Args>(proxy_args))...});
+    return message;
+}
+
+template<class R, class... Args>
+QDBusReply<R> CallFuncOverDBus(const QDBusAbstractInterface *interface,
+                               const QDBusMessage &message_template,
+                               Args &&... proxy_args)
+{
+    QDBusReply<R> res = interface->connection().call(MethodCall(message_template,
+                                                                std::forward<Args>(proxy_args)...),
+                                                     QDBus::Block,
+                                                     interface->timeout());
+    if (!res.isValid()) {
+        MeasuredCallFailed();
+    }
+    return res;
+}
+
+template<class TO, class F, class T, class... Args>
+QDBusPendingCall ProxyAsyncCallHelper(F f, T *obj, Args &... args)
+{
+    if (!obj)
+        throw ::hardbus::Exception{"service not registered"};
+    return (obj->*f)(TO{}(args)...);
+}
+
+template<class R, class... Args>
+QDBusReply<R> CallFuncOverDBus(std::false_type /*oneway*/,
+                               const QDBusAbstractInterface *interface,
+                               const QDBusMessage &message_template,
+                               Args &&... proxy_args)
+{
+    return CallFuncOverDBus<R>(interface, message_template, std::forward<Args>(proxy_args)...);
+}
+
+//! Sends the call without waiting for a reply.
+//! QDBusConnection::send marks method calls with NO_REPLY_EXPECTED
+template<class... Args>
+QDBusMessage SendFuncOverDBus(const QDBusAbstractInterface *interface,
+                              const QDBusMessage &message_template,
+                              Args &&... proxy_args)
+{
+    auto message = MethodCall(message_template, std::forward<Args>(proxy_args)...);
+    if (!interface->connection().send(message)) {
+        qWarning() << "Cannot send" << message.member() << interface->connection().lastError().message();
+        MeasuredCallFailed();
+    }
+    return message;
+}
+
+template<class R, class... Args>
+R CallFuncOverDBus(std::true_type /*oneway*/,
+                   const QDBusAbstractInterface *interface,
+                   const QDBusMessage &message_template,
+                   Args &&... proxy_args)
+{
+    SendFuncOverDBus(interface, message_template, std::forward<Args>(proxy_args)...);
+    return {};
+}
+
+template<class... Args>
+QDBusPendingCall CallFuncOverDBusAsync(std::false_type /*oneway*/,
+                                       const QDBusAbstractInterface *interface,
+                                       const QDBusMessage &message_template,
+                                       Args &&... proxy_args)
+{
+    return interface->connection().asyncCall(MethodCall(message_template,
+                                                        std::forward<Args>(proxy_args)...),
+                                             interface->timeout());
+}
+
+template<class... Args>
+QDBusPendingCall CallFuncOverDBusAsync(std::true_type /*oneway*/,
+                                       const QDBusAbstractInterface *interface,
+                                       const QDBusMessage &message_template,
+                                       Args &&... proxy_args)
+{
+    auto message = SendFuncOverDBus(interface, message_template, std::forward<Args>(proxy_args)...);
+    return QDBusPendingCall::fromCompletedCall(message.createReply());
+}
+
+template<class R, class ONEWAY, bool COMPRESSED>
+struct ExportReturnTypeFor
+{
+    using type = MethodProxyType<R, COMPRESSED>;
+};
+
+template<class R, bool COMPRESSED>
+struct ExportReturnTypeFor<R, std::true_type, COMPRESSED>
+{
+    static_assert(std::is_void<R>::value, "oneway functions must return void");
+    using type = void;
+};
+
+class FunctionRunnable : public QRunnable
+{
+public:
+    explicit FunctionRunnable(std::function<void()> f) : f_{std::move(f)} {}
+    void run() override { f_(); }
+
+private:
+    std::function<void()> f_;
+};
+
+//! Runs posted tasks on a thread pool one after another
+class SerialQueue : public std::enable_shared_from_this<SerialQueue>
+{
+public:
+    explicit SerialQueue(QThreadPool *pool) : pool_{pool} {}
+
+    void Post(std::function<void()> task)
+    {
+        {
+            QMutexLocker lock{&mutex_};
+            tasks_.push_back(std::move(task));
+            if (running_) {
+                return;
+            }
+            running_ = true;
+        }
+        auto self = shared_from_this();
+        pool_->start(new FunctionRunnable{[self] { self->RunAll(); }});
+    }
+
+private:
+    void RunAll()
+    {
+        forever {
+            std::function<void()> task;
+            {
+                QMutexLocker lock{&mutex_};
+                if (tasks_.empty()) {
+                    running_ = false;
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    QThreadPool *pool_;
+    QMutex mutex_;
+    std::deque<std::function<void()>> tasks_;
+    bool running_ = false;
+};
+
+template<class F>
+auto ReplyFromTask(const QDBusMessage &message, F &task)
+    -> std::enable_if_t<std::is_same<void, std::result_of_t<F()>>::value, QDBusMessage>
+{
+    task();
+    return message.createReply();
+}
+
+template<class F>
+auto ReplyFromTask(const QDBusMessage &message, F &task)
+    -> std::enable_if_t<!std::is_same<void, std::result_of_t<F()>>::value, QDBusMessage>
+{
+    return message.createReply(QVariant::fromValue(task()));
+}
+
+//! Calls of a dispatcher in the pool. Once it is closed, calls that did not
+//! start yet are answered with an error instead of running
+class DispatchLifetime
+{
+public:
+    //! Marks a call as running. False once closed
+    bool Enter()
+    {
+        QMutexLocker lock{&mutex_};
+        if (closed_) {
+            return false;
+        }
+        ++running_;
+        return true;
+    }
+
+    void Leave()
+    {
+        QMutexLocker lock{&mutex_};
+        if (--running_ == 0) {
+            idle_.wakeAll();
+        }
+    }
+
+    //! Refuses the calls still queued and waits for the running ones
+    void Close()
+    {
+        QMutexLocker lock{&mutex_};
+        closed_ = true;
+        while (running_ > 0) {
+            idle_.wait(&mutex_);
+        }
+    }
+
+private:
+    QMutex mutex_;
+    QWaitCondition idle_;
+    int running_ = 0;
+    bool closed_ = false;
+};
+
+//! Runs export calls on a thread pool and sends delayed replies. Destroying
+//! it waits for the calls running in the pool, and the queued ones fail
+class ExportDispatcher
+{
+public:
+    explicit ExportDispatcher(QThreadPool *pool) : pool_{pool} {}
+    ExportDispatcher(const ExportDispatcher &) = delete;
+    ExportDispatcher &operator=(const ExportDispatcher &) = delete;
+    ~ExportDispatcher() { lifetime_->Close(); }
+
+    template<class F>
+    void Dispatch(const QDBusMessage &message,
+                  QDBusConnection connection,
+                  const char *func_name,
+                  bool concurrent,
+                  F task)
+    {
+        message.setDelayedReply(true);
+        auto run = [message, connection, task, lifetime = lifetime_]() mutable {
+            if (!lifetime->Enter()) {
+                // the adaptor the task calls into is gone
+                if (message.isReplyRequired()) {
+                    connection.send(message.createErrorReply(QDBusError::UnknownObject,
+                                                             QStringLiteral("service is gone")));
+                }
+                return;
+            }
+            QDBusMessage reply;
+            try {
+                reply = ReplyFromTask(message, task);
+            } catch (const std::exception &e) {
+                reply = message.createErrorReply(QDBusError::Failed, QString::fromUtf8(e.what()));
+            } catch (...) {
+                // nothing may escape a QRunnable
+                reply = message.createErrorReply(QDBusError::Failed, QStringLiteral("unknown error"));
+            }
+            lifetime->Leave();
+            if (message.isReplyRequired()) {
+                connection.send(reply);
+            }
+        };
+        if (concurrent) {
+            pool_->start(new FunctionRunnable{std::move(run)});
+        } else {
+            Queue(func_name)->Post(std::move(run));
+        }
+    }
+
+private:
+    std::shared_ptr<SerialQueue> Queue(const char *func_name)
+    {
+        QMutexLocker lock{&mutex_};
+        auto &queue = queues_[func_name];
+        if (!queue) {
+            queue = std::make_shared<SerialQueue>(pool_);
+        }
+        return queue;
+    }
+
+    QThreadPool *pool_;
+    QMutex mutex_;
+    std::map<std::string, std::shared_ptr<SerialQueue>> queues_;
+    std::shared_ptr<DispatchLifetime> lifetime_{std::make_shared<DispatchLifetime>()};
+};
+
+//! Return type of an export slot. One-way functions return nothing, so no reply is built
+template<class R, class ONEWAY, bool COMPRESSED = false>
+using ExportReturnType = typename ExportReturnTypeFor<R, ONEWAY, COMPRESSED>::type;
+
+template<class PROXY, class S, class SF, class T, class TF>
+QMetaObject::Connection MakeProxyConnector(
+    MethodMetrics &metrics, S *source, SF source_signal, T *target, TF target_signal)
+{
+    auto m = &metrics;
+    return QObject::connect(source, source_signal, [=](auto &&... args) {
+        CallMeasurement measurement{*m, nullptr};
+        emit(target->*target_signal)(PROXY{}(std::forward<decltype(args)>(args))...);
+    });
+}
+
+//! Connects with \a connect when \a subscribed, disconnects \a connection otherwise
+template<class F>
+void UpdateSubscription(QMetaObject::Connection &connection, bool subscribed, F connect)
+{
+    if (subscribed && !connection) {
+        connection = connect();
+    } else if (!subscribed && connection) {
+        QObject::disconnect(connection);
+        connection = {};
+    }
+}
+
+template<class... Args>
+auto MakeProxyConnector1(Args &&... args)
+{
+    return MakeProxyConnector<FromProxyConverter>(std::forward<Args>(args)...);
+}
+
+//! Emits every signal of the service as its own D-Bus message
+struct DirectEmission
+{
+    //! Emits the signals of \a source as \a target_signal, sent over \a connection
+    template<class S, class SF, class T, class TF>
+    QMetaObject::Connection Connect(MethodMetrics &metrics,
+                                    S *source,
+                                    SF source_signal,
+                                    T *target,
+                                    TF target_signal,
+                                    const QDBusConnection &connection)
+    {
+        auto m = &metrics;
+        return QObject::connect(source, source_signal, [=](const auto &... args) {
+            CallMeasurement measurement{*m, nullptr};
+            FdTransfer::Scope fds{connection};
+            emit(target->*target_signal)(ToProxyConverter{}(args)...);
+        });
+    }
+
+    //! Sends the emissions of \a signal of \a object as signals of \a message_template
+    template<class T, class C, class... Args>
+    QMetaObject::Connection Relay(MethodMetrics &metrics,
+                                  T *object,
+                                  void (C::*signal)(Args...),
+                                  const QDBusMessage &message_template,
+                                  const QDBusConnection &connection)
+    {
+        auto m = &metrics;
+        return QObject::connect(object, signal, [=](const std::decay_t<Args> &... args) {
+            CallMeasurement measurement{*m, nullptr};
+            FdTransfer::Scope fds{connection};
+            auto message = message_template;
+            message.setArguments({QVariant::fromValue(ToProxyConverter{}(args))...});
+            connection.send(message);
+        });
+    }
+};
+
+//! Emits at most once per \a MS milliseconds. Emissions in between are dropped
+//! except the latest one, which is sent when the interval is over
+template<int MS>
+class LatestEmission
+{
+public:
+    LatestEmission()
+    {
+        timer_.setSingleShot(true);
+        timer_.setInterval(MS);
+        QObject::connect(&timer_, &QTimer::timeout, [this] { Flush(); });
+    }
+
+    template<class S, class SF, class T, class TF>
+    QMetaObject::Connection Connect(MethodMetrics &metrics,
+                                    S *source,
+                                    SF source_signal,
+                                    T *target,
+                                    TF target_signal,
+                                    const QDBusConnection &connection)
+    {
+        auto m = &metrics;
+        return QObject::connect(
+            source,
+            source_signal,
+            target,
+            [=](const auto &... args) {
+                Post([=] {
+                    CallMeasurement measurement{*m, nullptr};
+                    FdTransfer::Scope fds{connection};
+                    emit(target->*target_signal)(ToProxyConverter{}(args)...);
+                });
+            },
+            Qt::DirectConnection);
+    }
+
+    //! Sends the emissions of \a signal of \a object as signals of \a message_template
+    template<class T, class C, class... Args>
+    QMetaObject::Connection Relay(MethodMetrics &metrics,
+                                  T *object,
+                                  void (C::*signal)(Args...),
+                                  const QDBusMessage &message_template,
+                                  const QDBusConnection &connection)
+    {
+        auto m = &metrics;
+        return QObject::connect(object, signal, [=](const std::decay_t<Args> &... args) {
+            Post([=] {
+                CallMeasurement measurement{*m, nullptr};
+                FdTransfer::Scope fds{connection};
+                auto message = message_template;
+                message.setArguments({QVariant::fromValue(ToProxyConverter{}(args))...});
+                connection.send(message);
+            });
+        });
+    }
+
+private:
+    void Post(std::function<void()> emission)
+    {
+        {
+            QMutexLocker lock{&mutex_};
+            if (waiting_) {
+                pending_ = std::move(emission);
+                return;
+            }
+            waiting_ = true;
+        }
+        emission();
+        QMetaObject::invokeMethod(&timer_, [this] { timer_.start(); });
+    }
+
+    void Flush()
+    {
+        std::function<void()> emission;
+        {
+            QMutexLocker lock{&mutex_};
+            std::swap(emission, pending_);
+            if (!emission) {
+                waiting_ = false;
+                return;
+            }
+        }
+        emission();
+        timer_.start();
+    }
+
+    QMutex mutex_;
+    QTimer timer_;
+    std::function<void()> pending_;
+    bool waiting_ = false;
+};
+
+//! Collects up to \a N emissions, or the emissions of \a MS milliseconds, into one message
+template<int N, int MS>
+class BatchedEmission
+{
+public:
+    BatchedEmission()
+    {
+        timer_.setSingleShot(true);
+        timer_.setInterval(MS);
+        QObject::connect(&timer_, &QTimer::timeout, [this] { Flush(); });
+    }
+
+    template<class S, class SF, class T>
+    QMetaObject::Connection Connect(MethodMetrics &metrics,
+                                    S *source,
+                                    SF source_signal,
+                                    T *target,
+                                    void (T::*target_signal)(QVariantList),
+                                    const QDBusConnection &connection)
+    {
+        emit_ = [target, target_signal](const QVariantList &batch) {
+            emit(target->*target_signal)(batch);
+        };
+        auto m = &metrics;
+        return QObject::connect(
+            source,
+            source_signal,
+            target,
+            [=](const auto &... args) {
+                QVariantList emission;
+                {
+                    CallMeasurement measurement{*m, nullptr};
+                    FdTransfer::Scope fds{connection};
+                    emission = QVariantList{QVariant::fromValue(ToProxyConverter{}(args))...};
+                }
+                Add(emission);
+            },
+            Qt::DirectConnection);
+    }
+
+    //! Sends the emissions of \a signal of \a object in batches, as signals of \a message_template
+    template<class T, class C, class... Args>
+    QMetaObject::Connection Relay(MethodMetrics &metrics,
+                                  T *object,
+                                  void (C::*signal)(Args...),
+                                  const QDBusMessage &message_template,
+                                  const QDBusConnection &connection)
+    {
+        emit_ = [message_template, connection](const QVariantList &batch) {
+            auto message = message_template;
+            message.setArguments({QVariant::fromValue(batch)});
+            connection.send(message);
+        };
+        auto m = &metrics;
+        return QObject::connect(object, signal, [=](const std::decay_t<Args> &... args) {
+            QVariantList emission;
+            {
+                CallMeasurement measurement{*m, nullptr};
+                FdTransfer::Scope fds{connection};
+                emission = QVariantList{QVariant::fromValue(ToProxyConverter{}(args))...};
+            }
+            Add(emission);
+        });
+    }
+
+private:
+    void Add(const QVariantList &emission)
+    {
+        QVariantList full;
+        {
+            // the timer is driven under the lock, so its start and stop follow the batches in order
+            QMutexLocker lock{&mutex_};
+            batch_.append(QVariant{emission});
+            if (batch_.size() >= N) {
+                full.swap(batch_);
+                QMetaObject::invokeMethod(&timer_, [this] { timer_.stop(); });
+            } else if (batch_.size() == 1) {
+                QMetaObject::invokeMethod(&timer_, [this] { timer_.start(); });
+            }
+        }
+        if (!full.isEmpty()) {
+            emit_(full);
+        }
+    }
+
+    void Flush()
+    {
+        QVariantList batch;
+        {
+            QMutexLocker lock{&mutex_};
+            batch.swap(batch_);
+        }
+        if (!batch.isEmpty()) {
+            emit_(batch);
+        }
+    }
+
+    QMutex mutex_;
+    QTimer timer_;
+    QVariantList batch_;
+    std::function<void(const QVariantList &)> emit_;
+};
+
+template<class T, class C, class... Args, std::size_t... I>
+void EmitFromVariants(T *target, void (C::*target_signal)(Args...), const QVariantList &args, std::index_sequence<I...>)
+{
+    emit(target->*target_signal)(
+        FromProxyConverter{}(ProxyFromVariant<ProxyType<Args>>(args.at(int(I))))...);
+}
+
+template<class R>
+QVariant BatchReplyValue(std::function<R()> f)
+{
+    return QVariant::fromValue(f());
+}
+
+template<>
+inline QVariant BatchReplyValue<void>(std::function<void()> f)
+{
+    f();
+    return QVariant{QString{}};
+}
+
+template<class T, class R, class... Args, std::size_t... I>
+QVariant InvokeFromVariants(T *obj, R (T::*f)(Args...), const QVariantList &args, std::index_sequence<I...>)
+{
+    using ArgsTuple = std::tuple<std::decay_t<Args>...>;
+    return BatchReplyValue<R>([&] {
+        return (obj->*f)(
+            ProxyFromVariant<std::tuple_element_t<I, ArgsTuple>>(args.at(int(I)))..., QDBusMessage{});
+    });
+}
+
+//! Calls export slot \a f with arguments received in a batch. An empty
+//! message makes the slot run the call right away
+template<class T, class R, class... Args>
+QVariant InvokeFromVariants(T *obj, R (T::*f)(Args...), const QVariantList &args)
+{
+    constexpr int size = int(sizeof...(Args)) - 1;
+    if (args.size() != size) {
+        throw ::hardbus::Exception{QStringLiteral("wrong number of arguments")};
+    }
+    return InvokeFromVariants(obj, f, args, std::make_index_sequence<size>{});
+}
+
+//! Runs the calls of a batch in order with \a invoke, making a list of
+//! the error message and the return value of each call
+template<class F>
+QVariantList RunBatch(const QStringList &functions, const QVariantList &arguments, F invoke)
+{
+    QVariantList results;
+    for (int i = 0; i < functions.size(); ++i) {
+        QVariantList result{QString{}, QString{}};
+        try {
+            result[1] = invoke(functions.at(i), ProxyFromVariant<QVariantList>(arguments.value(i)));
+        } catch (const std::exception &e) {
+            result[0] = QString::fromUtf8(e.what());
+        }
+        results.append(QVariant{result});
+    }
+    return results;
+}
+
+//! Arguments of the reply to a call returning \a R, converted with \a TO
+template<class R, class TO>
+struct ReplyArguments
+{
+    template<class F>
+    static QVariantList Get(const F &f)
+    {
+        return {QVariant::fromValue(TO{}(f()))};
+    }
+};
+
+template<class TO>
+struct ReplyArguments<void, TO>
+{
+    template<class F>
+    static QVariantList Get(const F &f)
+    {
+        f();
+        return {};
+    }
+};
+
+template<class R, bool COMPRESSED, class... Args, class T, class F, std::size_t... I>
+QVariantList InvokeWithProxies(T *object, F f, const QVariantList &args, std::index_sequence<I...>)
+{
+    if (args.size() != int(sizeof...(Args))) {
+        throw ::hardbus::Exception{QStringLiteral("wrong number of arguments")};
+    }
+    return ReplyArguments<R, MethodToProxyConverter<COMPRESSED>>::Get([&]() -> R {
+        return (object->*f)(FromProxyConverter{}(
+            ProxyFromVariant<MethodProxyType<Args, COMPRESSED>>(args.at(int(I))))...);
+    });
+}
+
+//! Calls \a f of \a object with the proxy arguments of a message, returning
+//! the arguments of the reply
+template<bool COMPRESSED, class T, class C, class R, class... Args>
+QVariantList InvokeWithProxies(T *object, R (C::*f)(Args...), const QVariantList &args)
+{
+    return InvokeWithProxies<R, COMPRESSED, std::decay_t<Args>...>(object,
+                                                                   f,
+                                                                   args,
+                                                                   std::index_sequence_for<Args...>{});
+}
+
+template<bool COMPRESSED, class T, class C, class R, class... Args>
+QVariantList InvokeWithProxies(T *object, R (C::*f)(Args...) const, const QVariantList &args)
+{
+    return InvokeWithProxies<R, COMPRESSED, std::decay_t<Args>...>(object,
+                                                                   f,
+                                                                   args,
+                                                                   std::index_sequence_for<Args...>{});
+}
+
+//! Relays of the signals of an object of a service tree, with the
+//! emission state of each signal
+struct SignalRelays
+{
+    std::vector<QMetaObject::Connection> connections;
+    std::vector<std::shared_ptr<void>> emissions;
+};
+
+template<class P>
+QString IntrospectArg(const char *direction)
+{
+    auto xml = QStringLiteral("<arg type=\"%1\"").arg(
+        QLatin1String(QDBusMetaType::typeToSignature(qMetaTypeId<P>())));
+    if (direction) {
+        xml += QStringLiteral(" direction=\"%1\"").arg(QLatin1String(direction));
+    }
+    return xml + QStringLiteral("/>");
+}
+
+template<bool COMPRESSED, class... Args>
+QString IntrospectArgs(const char *direction)
+{
+    QString xml;
+    for (const auto &arg :
+         std::array<QString, sizeof...(Args)>{{IntrospectArg<MethodProxyType<Args, COMPRESSED>>(direction)...}}) {
+        xml += arg;
+    }
+    return xml;
+}
+
+template<class R, bool COMPRESSED>
+QString IntrospectResult(std::false_type /*void*/)
+{
+    return IntrospectArg<MethodProxyType<R, COMPRESSED>>("out");
+}
+
+template<class R, bool COMPRESSED>
+QString IntrospectResult(std::true_type /*void*/)
+{
+    return {};
+}
+
+template<bool COMPRESSED, class R, class... Args>
+QString IntrospectMethod(const char *name)
+{
+    return QStringLiteral("<method name=\"%1\">").arg(QLatin1String(name))
+           + IntrospectArgs<COMPRESSED, std::decay_t<Args>...>("in")
+           + IntrospectResult<R, COMPRESSED>(std::is_void<R>{}) + QStringLiteral("</method>");
+}
+
+//! Introspection data of method \a f, named \a name
+template<bool COMPRESSED, class C, class R, class... Args>
+QString IntrospectMethod(const char *name, R (C::*)(Args...))
+{
+    return IntrospectMethod<COMPRESSED, R, Args...>(name);
+}
+
+template<bool COMPRESSED, class C, class R, class... Args>
+QString IntrospectMethod(const char *name, R (C::*)(Args...) const)
+{
+    return IntrospectMethod<COMPRESSED, R, Args...>(name);
+}
+
+template<class C, class... Args>
+QString IntrospectSignal(std::false_type /*batched*/, const char *name, void (C::*)(Args...))
+{
+    return QStringLiteral("<signal name=\"%1\">").arg(QLatin1String(name))
+           + IntrospectArgs<false, std::decay_t<Args>...>(nullptr) + QStringLiteral("</signal>");
+}
+
+template<class C, class... Args>
+QString IntrospectSignal(std::true_type /*batched*/, const char *name, void (C::*)(Args...))
+{
+    return QStringLiteral("<signal name=\"%1\">").arg(QLatin1String(name))
+           + IntrospectArg<QVariantList>(nullptr) + QStringLiteral("</signal>");
+}
+
+//! Introspection data of read-only property \a name
+template<class T>
+QString IntrospectProperty(const char *name)
+{
+    return QStringLiteral("<property name=\"%1\" type=\"%2\" access=\"read\"/>")
+        .arg(QLatin1String(name), QLatin1String(QDBusMetaType::typeToSignature(qMetaTypeId<ProxyType<T>>())));
+}
+
+/// Properties
+
+inline QString PropertiesInterface()
+{
+    return QStringLiteral("org.freedesktop.DBus.Properties");
+}
+
+//! Sends `PropertiesChanged` of \a path with the value \a get returns each
+//! time \a object emits \a notify, while \a context lives
+template<class T, class Notify, class Get>
+QMetaObject::Connection RelayPropertyChanges(QObject *context,
+                                             T *object,
+                                             Notify notify,
+                                             const char *interface,
+                                             const char *name,
+                                             Get get,
+                                             const QString &path,
+                                             const QDBusConnection &connection)
+{
+    return QObject::connect(object, notify, context, [=] {
+        FdTransfer::Scope fds{connection};
+        auto message = QDBusMessage::createSignal(path, PropertiesInterface(), QStringLiteral("PropertiesChanged"));
+        message.setArguments({QLatin1String(interface), QVariantMap{{QLatin1String(name), get()}}, QStringList{}});
+        connection.send(message);
+    });
+}
+
+//! Values of all properties of \a interface, empty if the service does not answer
+inline QVariantMap GetAllProperties(const QDBusAbstractInterface &interface)
+{
+    auto message = QDBusMessage::createMethodCall(interface.service(),
+                                                  interface.path(),
+                                                  PropertiesInterface(),
+                                                  QStringLiteral("GetAll"));
+    message.setArguments({interface.interface()});
+    QDBusReply<QVariantMap> reply = interface.connection().call(message, QDBus::Block, interface.timeout());
+    if (!reply.isValid()) {
+        qWarning() << "Cannot get properties of" << interface.interface() << reply.error().message();
+        return {};
+    }
+    return reply.value();
+}
+
+//! Emits notify signal \a notify of \a target, which may or may not take the new value
+template<class T, class C, class V>
+void EmitNotify(T *target, void (C::*notify)(), const V &)
+{
+    emit(target->*notify)();
+}
+
+template<class T, class C, class A, class V>
+void EmitNotify(T *target, void (C::*notify)(A), const V &value)
+{
+    emit(target->*notify)(value);
+}
+
+template<class S, class SF, class T, class TF>
+QMetaObject::Connection MakeImportConnector(
+    std::false_type /*batched*/, MethodMetrics &metrics, S *source, SF source_signal, T *target, TF target_signal)
+{
+    return MakeProxyConnector1(metrics, source, source_signal, target, target_signal);
+}
+
+//! Unpacks a batch back into individual emissions
+template<class S, class SF, class T, class C, class... Args>
+QMetaObject::Connection MakeImportConnector(std::true_type /*batched*/,
+                                            MethodMetrics &metrics,
+                                            S *source,
+                                            SF source_signal,
+                                            T *target,
+                                            void (C::*target_signal)(Args...))
+{
+    auto m = &metrics;
+    return QObject::connect(source, source_signal, [=](const QVariantList &batch) {
+        for (const auto &v : batch) {
+            const auto args = ProxyFromVariant<QVariantList>(v);
+            if (args.size() != int(sizeof...(Args))) {
+                qWarning() << "Unexpected batched signal arguments" << args;
+                continue;
+            }
+            CallMeasurement measurement{*m, nullptr};
+            EmitFromVariants(target, target_signal, args, std::index_sequence_for<Args...>{});
+        }
+    });
+}
+
+template<typename T, typename R, typename... Args>
+R DeduceReturnType(R (T::*mf)(Args...));
+
+template<typename T, typename R, typename... Args>
+R DeduceReturnType(R (T::*mf)(Args...) const);
+
+inline void ExportAdaptor(QObject *parent,
+                          QDBusConnection connection,
+                          QString object_path,
+                          QString service_name)
+{
+    if (!connection.registerObject(object_path, parent)) {
+        qWarning() << "Cannot register object at path" << object_path;
+        throw ::hardbus::Exception{"Cannot register object at path" + object_path};
+    }
+    if (!service_name.isEmpty() && !connection.registerService(service_name)) {
+        qWarning() << "Cannot register service" << service_name;
+        throw ::hardbus::Exception{"Cannot register service" + object_path};
+    }
+}
+
+template <class R, class F>
+void ReturnValueOrVoid(const F &f, std::true_type)
+{
+    f();
+}
+
+template <class R, class F>
+R ReturnValueOrVoid(const F &f, std::false_type)
+{
+    return f();
+}
+
+//! Result of a call served by an in-process service
+template<class R>
+struct LocalResult
+{
+    template<class F>
+    explicit LocalResult(F &f) : value(f())
+    {}
+
+    R Take() { return std::move(value); }
+
+    R value;
+};
+
+template<>
+struct LocalResult<void>
+{
+    template<class F>
+    explicit LocalResult(F &f)
+    {
+        f();
+    }
+
+    void Take() {}
+};
+
+//! Runs \a f in the thread of \a obj, blocking until it is done
+template<class R, class F>
+std::shared_ptr<LocalResult<R>> LocalInvoke(QObject *obj, F f)
+{
+    if (obj->thread() == QThread::currentThread()) {
+        return std::make_shared<LocalResult<R>>(f);
+    }
+    std::shared_ptr<LocalResult<R>> result;
+    std::exception_ptr error;
+    QMetaObject::invokeMethod(
+        obj,
+        [&] {
+            try {
+                result = std::make_shared<LocalResult<R>>(f);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        },
+        Qt::BlockingQueuedConnection);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result;
+}
+
+template<class R, class F>
+R LocalCall(QObject *obj, F f)
+{
+    return LocalInvoke<R>(obj, f)->Take();
+}
+
+//! Result of an asynchronous call served by an in-process service, available
+//! once the call ran in the thread of the service
+template<class R>
+class LocalPending
+{
+public:
+    //! Runs \a f, keeping its result or the error it throws
+    template<class F>
+    void Run(F &f)
+    {
+        try {
+            Finish(std::make_shared<LocalResult<R>>(f), nullptr, {});
+        } catch (const std::exception &e) {
+            Finish(nullptr, std::current_exception(), QString::fromUtf8(e.what()));
+        } catch (...) {
+            Finish(nullptr, std::current_exception(), QStringLiteral("unknown error"));
+        }
+    }
+
+    //! Fails the call with \a message, unless it is finished already
+    void Fail(const QString &message)
+    {
+        Finish(nullptr, std::make_exception_ptr(::hardbus::Exception{message}), message);
+    }
+
+    bool IsFinished() const
+    {
+        QMutexLocker lock{&mutex_};
+        return finished_;
+    }
+
+    void Wait() const
+    {
+        QMutexLocker lock{&mutex_};
+        while (!finished_) {
+            finished_changed_.wait(&mutex_);
+        }
+    }
+
+    //! Error message, empty unless the call threw
+    QString ErrorMessage() const
+    {
+        QMutexLocker lock{&mutex_};
+        return error_message_;
+    }
+
+    //! Waits for the result. Rethrows the error of the call
+    const LocalResult<R> &Result() const
+    {
+        Wait();
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return *result_;
+    }
+
+    //! Calls \a callback once the call is finished, right away if it is
+    void OnFinished(std::function<void()> callback)
+    {
+        {
+            QMutexLocker lock{&mutex_};
+            if (!finished_) {
+                callbacks_.push_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+private:
+    void Finish(std::shared_ptr<const LocalResult<R>> result, std::exception_ptr error, const QString &message)
+    {
+        std::vector<std::function<void()>> callbacks;
+        {
+            QMutexLocker lock{&mutex_};
+            if (finished_) {
+                return;
+            }
+            result_ = std::move(result);
+            error_ = std::move(error);
+            error_message_ = message;
+            finished_ = true;
+            finished_changed_.wakeAll();
+            callbacks.swap(callbacks_);
+        }
+        for (auto &callback : callbacks) {
+            callback();
+        }
+    }
+
+    mutable QMutex mutex_;
+    mutable QWaitCondition finished_changed_;
+    bool finished_ = false;
+    std::shared_ptr<const LocalResult<R>> result_;
+    std::exception_ptr error_;
+    QString error_message_;
+    std::vector<std::function<void()>> callbacks_;
+};
+
+//! Runs \a f in the thread of \a obj without waiting for it. The call fails
+//! if \a obj is deleted before it runs
+template<class R, class F>
+std::shared_ptr<LocalPending<R>> LocalInvokeAsync(std::false_type /*oneway*/, QObject *obj, F f)
+{
+    auto pending = std::make_shared<LocalPending<R>>();
+    if (obj->thread() == QThread::currentThread()) {
+        pending->Run(f);
+        return pending;
+    }
+    // dropped with the queued call when obj goes away first
+    std::shared_ptr<void> abandoned{nullptr, [pending](void *) { pending->Fail(QStringLiteral("service is gone")); }};
+    QMetaObject::invokeMethod(
+        obj, [pending, abandoned, f]() mutable { pending->Run(f); }, Qt::QueuedConnection);
+    return pending;
+}
+
+//! One-way calls are queued even in the thread of \a obj and are finished
+//! right away, as over the bus
+template<class R, class F>
+std::shared_ptr<LocalPending<R>> LocalInvokeAsync(std::true_type /*oneway*/, QObject *obj, F f)
+{
+    static_assert(std::is_void<R>::value, "oneway functions must return void");
+    QMetaObject::invokeMethod(
+        obj,
+        [f]() mutable {
+            try {
+                f();
+            } catch (const std::exception &e) {
+                qWarning() << "One-way call failed:" << e.what();
+            } catch (...) {
+                qWarning() << "One-way call failed";
+            }
+        },
+        Qt::QueuedConnection);
+    auto pending = std::make_shared<LocalPending<R>>();
+    auto nothing = [] {};
+    pending->Run(nothing);
+    return pending;
+}
+
+//! Shares \a adaptor, a child of the access object, with the calls using it.
+//! The last one deletes it in its own thread, unless its parent did already
+template<class T>
+std::shared_ptr<T> ShareAdaptor(T *adaptor)
+{
+    QPointer<T> guard{adaptor};
+    return std::shared_ptr<T>{adaptor, [guard](T *) {
+                                  if (guard) {
+                                      guard->deleteLater();
+                                  }
+                              }};
+}
+
+//! Asynchronous calls recorded by a batch, sent as one `hardbus_batch` call
+struct BatchState
+{
+    int Add(const char *func_name, const QVariantList &args)
+    {
+        QMutexLocker lock{&mutex};
+        functions.append(QLatin1String(func_name));
+        arguments.append(QVariant{args});
+        return functions.size() - 1;
+    }
+
+    bool IsSent() const
+    {
+        QMutexLocker lock{&mutex};
+        return sent;
+    }
+
+    //! The call sending the batch. Only meaningful once it is sent
+    QDBusPendingCall Call() const
+    {
+        QMutexLocker lock{&mutex};
+        return call;
+    }
+
+    //! Sets the call sending the batch, then runs the continuations waiting for it
+    void SetCall(const QDBusPendingCall &sending)
+    {
+        std::vector<std::function<void(const QDBusPendingCall &)>> waiting;
+        {
+            QMutexLocker lock{&mutex};
+            call = sending;
+            sent = true;
+            waiting.swap(continuations);
+        }
+        for (auto &continuation : waiting) {
+            continuation(sending);
+        }
+    }
+
+    //! Calls \a continuation with the call sending the batch, once it is sent
+    void OnSent(std::function<void(const QDBusPendingCall &)> continuation) const
+    {
+        QMutexLocker lock{&mutex};
+        if (!sent) {
+            continuations.push_back(std::move(continuation));
+            return;
+        }
+        const auto sending = call;
+        lock.unlock();
+        continuation(sending);
+    }
+
+    mutable QMutex mutex;
+    QStringList functions;
+    QVariantList arguments;
+    QDBusPendingCall call = QDBusPendingCall::fromError(
+        QDBusError{QDBusError::Failed, QStringLiteral("batch is not sent yet")});
+    bool sent = false;
+    mutable std::vector<std::function<void(const QDBusPendingCall &)>> continuations;
+};
+
+//! Result of call \a index of a batch: a list of the error message and the return value
+inline QVariant BatchResult(const QDBusPendingCall &call, int index)
+{
+    QDBusPendingReply<QVariantList> reply = call;
+    reply.waitForFinished();
+    if (reply.isError()) {
+        throw ::hardbus::Exception{reply.error().message()};
+    }
+    const auto result = ProxyFromVariant<QVariantList>(reply.value().value(index));
+    if (result.size() != 2) {
+        throw ::hardbus::Exception{QStringLiteral("malformed batch reply")};
+    }
+    const auto error = result.at(0).toString();
+    if (!error.isEmpty()) {
+        throw ::hardbus::Exception{error};
+    }
+    return result.at(1);
+}
+
+template<class R>
+struct PendingValue
+{
+    static R Get(const LocalResult<R> &local) { return local.value; }
+
+    static R Get(const QDBusPendingCall &call)
+    {
+        QDBusPendingReply<> reply = call;
+        reply.waitForFinished();
+        if (reply.isError()) {
+            throw ::hardbus::Exception{reply.error().message()};
+        }
+        return FromReplyVariant<R>(reply.argumentAt(0), IsCompressible<R>{});
+    }
+
+    static R Get(const QDBusPendingCall &call, int index)
+    {
+        return FromReplyVariant<R>(BatchResult(call, index), IsCompressible<R>{});
+    }
+};
+
+template<>
+struct PendingValue<void>
+{
+    static void Get(const LocalResult<void> &) {}
+
+    static void Get(const QDBusPendingCall &call)
+    {
+        QDBusPendingReply<> reply = call;
+        reply.waitForFinished();
+        if (reply.isError()) {
+            throw ::hardbus::Exception{reply.error().message()};
+        }
+    }
+
+    static void Get(const QDBusPendingCall &call, int index) { BatchResult(call, index); }
+};
+
+//! Whether QDataStream has an operator for \a T, as far as its declaration tells
+template<class T, class = void>
+struct HasDataStreamOperatorImpl : std::false_type
+{};
+
+template<class T>
+struct HasDataStreamOperatorImpl<T,
+                                 VoidT<decltype(std::declval<QDataStream &>() << std::declval<const T &>())>>
+    : std::true_type
+{};
+
+template<class T>
+struct HasDataStreamOperator : HasDataStreamOperatorImpl<T>
+{};
+
+//! Container operators are declared for any element type
+template<class T>
+struct HasDataStreamOperator<QList<T>> : HasDataStreamOperator<T>
+{};
+
+template<class T>
+struct HasDataStreamOperator<QVector<T>> : HasDataStreamOperator<T>
+{};
+
+template<class K, class V>
+struct HasDataStreamOperator<QMap<K, V>>
+    : std::integral_constant<bool, HasDataStreamOperator<K>::value && HasDataStreamOperator<V>::value>
+{};
+
+template<class T>
+void AppendCacheKey(QDataStream &stream, const T &v, std::integral_constant<ProxyKind, ProxyKind::Binary>)
+{
+    stream << ToProxyBinary(v);
+}
+
+template<class T, ProxyKind KIND>
+void AppendCacheKey(QDataStream &stream, const T &v, std::integral_constant<ProxyKind, KIND>)
+{
+    static_assert(HasDataStreamOperator<ProxyType<T>>::value,
+                  "arguments of cached functions must be serializable with QDataStream");
+    stream << ToProxy(v);
+}
+
+template<class... Args>
+QByteArray CacheKey(const Args &... args)
+{
+    QByteArray key;
+    QDataStream stream{&key, QIODevice::WriteOnly};
+    int expand[] = {0, (AppendCacheKey(stream, args, ProxyKindOf<std::decay_t<Args>>{}), 0)...};
+    Q_UNUSED(expand);
+    return key;
+}
+
+//! Results of `cached` functions of an access object, keyed by function and arguments
+class CallCache
+{
+public:
+    template<class R, class F>
+    R Get(const char *func_name, int ttl_ms, const QByteArray &key, F compute)
+    {
+        quint64 generation = 0;
+        {
+            QMutexLocker lock{&mutex_};
+            auto &function = functions_[func_name];
+            auto it = function.entries.find(key);
+            if (it != function.entries.end()) {
+                if (it->second.expires > Clock::now()) {
+                    ++stats_.hits;
+                    return *std::static_pointer_cast<const R>(it->second.value);
+                }
+                function.entries.erase(it);
+                ++stats_.evictions;
+            }
+            ++stats_.misses;
+            generation = function.generation;
+        }
+        auto value = std::make_shared<const R>(compute());
+        QMutexLocker lock{&mutex_};
+        auto &function = functions_[func_name];
+        // invalidated while computing, the value may predate the change
+        if (function.generation != generation) {
+            return *value;
+        }
+        const auto now = Clock::now();
+        if (function.entries.size() >= function.sweep_at) {
+            Sweep(function, now);
+        }
+        function.entries[key] = Entry{value, now + std::chrono::milliseconds{ttl_ms}};
+        return *value;
+    }
+
+    void Invalidate(const char *func_name)
+    {
+        QMutexLocker lock{&mutex_};
+        Drop(functions_[func_name]);
+    }
+
+    void Clear()
+    {
+        QMutexLocker lock{&mutex_};
+        for (auto &function : functions_) {
+            Drop(function.second);
+        }
+    }
+
+    ::hardbus::CacheStats Stats() const
+    {
+        QMutexLocker lock{&mutex_};
+        return stats_;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        std::shared_ptr<const void> value;
+        Clock::time_point expires;
+    };
+
+    struct Function
+    {
+        std::map<QByteArray, Entry> entries;
+        //! Incremented by each invalidation, so calls running meanwhile do not store their result
+        quint64 generation = 0;
+        //! Expired entries are dropped once there are this many entries
+        std::size_t sweep_at = 16;
+    };
+
+    void Drop(Function &function)
+    {
+        stats_.evictions += function.entries.size();
+        function.entries.clear();
+        ++function.generation;
+    }
+
+    //! Drops expired entries. Sweeps again once the entries doubled, so it is amortized over the inserts
+    void Sweep(Function &function, Clock::time_point now)
+    {
+        for (auto it = function.entries.begin(); it != function.entries.end();) {
+            if (it->second.expires <= now) {
+                it = function.entries.erase(it);
+                ++stats_.evictions;
+            } else {
+                ++it;
+            }
+        }
+        function.sweep_at = qMax<std::size_t>(16, function.entries.size() * 2);
+    }
+
+    mutable QMutex mutex_;
+    std::map<std::string, Function> functions_;
+    ::hardbus::CacheStats stats_;
+};
+
+//! Function without `cached` spec: always calls \a f
+template<class R, class F, class... Args>
+R CachedCall(std::integral_constant<int, 0>, CallCache &, const char *, F f, const Args &...)
+{
+    return f();
+}
+
+template<class R, class F, class... Args, int TTL>
+R CachedCall(std::integral_constant<int, TTL>, CallCache &cache, const char *func_name, F f, const Args &... args)
+{
+    static_assert(!std::is_void<R>::value, "only functions returning a value can be cached");
+    return cache.Get<R>(func_name, TTL, CacheKey(args...), f);
+}
+
+} // namespace internal
+
+/// Asynchronous calls
+
+//! Typed result of an asynchronous call.
+//! The reply is converted to \a T only when Value() is called
+template<class T>
+class PendingReply
+{
+public:
+    explicit PendingReply(QDBusPendingCall call) : call_{std::move(call)} {}
+
+    //! Reply of an in-process call, finished once the service ran it
+    explicit PendingReply(std::shared_ptr<internal::LocalPending<T>> local)
+        : call_{QDBusPendingCall::fromCompletedCall(QDBusMessage{})}, local_{std::move(local)}
+    {}
+
+    //! Reply of call \a index of a batch. It is unfinished until the batch is sent
+    PendingReply(std::shared_ptr<const internal::BatchState> batch, int index)
+        : call_{batch->Call()}, batch_{std::move(batch)}, batch_index_{index}
+    {}
+
+    bool IsFinished() const
+    {
+        if (batch_ && !batch_->IsSent()) {
+            return false;
+        }
+        return local_ ? local_->IsFinished() : Call().isFinished();
+    }
+
+    //! Returns right away while the batch of the call is not sent
+    void WaitForFinished()
+    {
+        if (local_) {
+            local_->Wait();
+        } else if (!batch_ || batch_->IsSent()) {
+            Call().waitForFinished();
+        }
+    }
+
+    bool IsError() const
+    {
+        if (batch_ && !batch_->IsSent()) {
+            return false;
+        }
+        return local_ ? !Error().message().isEmpty() : Call().isError();
+    }
+
+    QDBusError Error() const
+    {
+        if (batch_ && !batch_->IsSent()) {
+            return {};
+        }
+        if (!local_) {
+            return Call().error();
+        }
+        const auto message = local_->ErrorMessage();
+        return message.isEmpty() ? QDBusError{} : QDBusError{QDBusError::Failed, message};
+    }
+
+    QDBusPendingCall Call() const { return batch_ ? batch_->Call() : call_; }
 
-///////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////// PUBLIC MACRO ////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////////
+    //! Blocks until the reply arrives. Throws hardbus::Exception on error,
+    //! or when the batch of the call is not sent yet
+    T Value() const
+    {
+        if (batch_) {
+            if (!batch_->IsSent()) {
+                throw Exception{QStringLiteral("batch is not sent yet")};
+            }
+            return internal::PendingValue<T>::Get(batch_->Call(), batch_index_);
+        }
+        return local_ ? internal::PendingValue<T>::Get(local_->Result())
+                      : internal::PendingValue<T>::Get(call_);
+    }
 
-#define HARDBUS_DEFINE_SERVICE(TAG, INTERFACE, API, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
-    struct TAG \
-    { \
-        HARDBUS_INTERNAL_DEFINE_TRAITS_( \
-            TAG, INTERFACE, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
-        HARDBUS_INTERNAL_DEFINE_EXPORT_ADAPTOR_(TAG, BUS_INTERFACE, API) \
-        HARDBUS_INTERNAL_DEFINE_IMPORT_ADAPTOR_(TAG, API) \
-        HARDBUS_INTERNAL_DEFINE_ACCESS_ADAPTOR_(TAG, API) \
-        static const char *ServiceName() {return BUS_SERVICE;} \
-        static const char *ServicePath() {return BUS_PATH;} \
-        static const char *ServiceInterface() {return BUS_INTERFACE;} \
-        static QDBusConnection Connection() {return BUS_TYPE;} \
-        static void RegisterService(INTERFACE *service) { new ExporAdaptorFor##TAG(service); } \
-        static INTERFACE *CreateServiceInterface(QObject *parent = nullptr) \
-        { \
-            return new AccessFor##TAG{parent}; \
-        } \
-        static bool WaitAndConnectService(INTERFACE *service) \
-        { \
-            hardbus::WaitForServiceRegistration(BUS_SERVICE, BUS_TYPE); \
-            auto casted = qobject_cast<AccessFor##TAG *>(service); \
-            if (!casted) { \
-                qWarning() << "Wrong instance to connect to" << BUS_SERVICE; \
-                return false; \
-            } \
-            if (casted->dbus_interface_ != nullptr) { \
-                qWarning() << "Can't reconnect previously connected service " << BUS_SERVICE; \
-                return false; \
-            } \
-            casted->dbus_interface_ = new ImportAdaptorFor##TAG{casted}; \
-            return true; \
-        } \
-        static INTERFACE *CreateAndConnectService(QObject *parent = nullptr) \
-        { \
-            auto service = CreateServiceInterface(parent); \
-            WaitAndConnectService(service);\
-            return service; \
-        } \
-    };
+    //! Calls \a callback with this reply in the thread of \a context once it
+    //! is finished. A call of a batch waits for the batch to be sent first
+    template<class F>
+    void Then(QObject *context, F callback) const
+    {
+        if (local_) {
+            QPointer<QObject> guard{context};
+            local_->OnFinished([guard, callback, self = *this]() {
+                if (guard) {
+                    QMetaObject::invokeMethod(
+                        guard.data(), [callback, self]() mutable { callback(self); }, Qt::QueuedConnection);
+                }
+            });
+            return;
+        }
+        if (batch_) {
+            QPointer<QObject> guard{context};
+            batch_->OnSent([guard, callback, self = *this](const QDBusPendingCall &call) {
+                if (guard) {
+                    QMetaObject::invokeMethod(guard.data(), [guard, callback, self, call] {
+                        if (guard) {
+                            self.Watch(call, guard.data(), callback);
+                        }
+                    });
+                }
+            });
+            return;
+        }
+        Watch(Call(), context, callback);
+    }
 
-#define HARDBUS_DEFINE_SERVICE_IMPL(TAG) \
-    W_OBJECT_IMPL(TAG::ExporAdaptorFor##TAG); \
-    W_OBJECT_IMPL(TAG::ImportAdaptorFor##TAG); \
-    W_OBJECT_IMPL(TAG::AccessFor##TAG);
+private:
+    template<class F>
+    void Watch(const QDBusPendingCall &call, QObject *context, F callback) const
+    {
+        auto watcher = new QDBusPendingCallWatcher{call, context};
+        QObject::connect(watcher,
+                         &QDBusPendingCallWatcher::finished,
+                         context,
+                         [watcher, callback, self = *this]() mutable {
+                             callback(self);
+                             watcher->deleteLater();
+                         });
+    }
 
-///////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////// PUBLIC ///////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////////
+    QDBusPendingCall call_;
+    std::shared_ptr<internal::LocalPending<T>> local_;
+    std::shared_ptr<const internal::BatchState> batch_;
+    int batch_index_ = 0;
+};
 
-namespace hardbus
+//! Records the asynchronous calls made on \a Access while it exists,
+//! then sends them as one message. The calls run in order on the service
+template<class Access>
+class Batch
 {
-//! Customization point. Defines how types are converted to string and back
-//! Must provide QString ToString(T) and T FromString() methods
-template<class T, class = void>
-struct ProxyStringConverter;
+public:
+    explicit Batch(Access *access) : access_{access} { access_->BeginBatch(); }
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    ~Batch() { access_->SendBatch(); }
 
-//! Exports \a service to the worlds
-template<class Traits>
-void RegisterService(typename Traits::interface *service, Traits = {})
+private:
+    Access *access_;
+};
+
+namespace internal
 {
-    new typename Traits::dbus_export(service);
-}
+//! Reply of org.freedesktop.DBus.ObjectManager.GetManagedObjects
+using ManagedObjects = QMap<QDBusObjectPath, QMap<QString, QVariantMap>>;
 
-//! Creates a service access object
-template<class Traits>
-auto CreateServiceInterface(Traits = {}, QObject *parent = nullptr) -> typename Traits::interface *
+inline QString ObjectManagerInterface()
 {
-    return new typename Traits::access{parent};
+    return QStringLiteral("org.freedesktop.DBus.ObjectManager");
 }
+} // namespace internal
 
-//Checks if service
-inline bool IsServiceRegistered(const QString &service_name, const QDBusConnection &connection)
+//! How a service tree finds the objects of its ids. Ids must be valid
+//! object path elements
+template<class Interface>
+struct ObjectTreeOptions
 {
-    bool is_registered = connection.interface()->isServiceRegistered(service_name);
-    return is_registered;
-}
+    //! Finds the object of an id. It stays owned by the caller. Introspection
+    //! calls it, and list, in the thread of the connection
+    std::function<Interface *(const QString &id)> lookup;
+    //! Creates the object of an id on its first call, when lookup finds none.
+    //! It is owned by the tree afterwards
+    std::function<Interface *(const QString &id)> factory;
+    //! Ids reported by GetManagedObjects besides the objects in use
+    std::function<QStringList()> list;
+    //! Objects unused for this long are forgotten, and deleted if the
+    //! factory created them. -1 keeps them
+    int idle_timeout_ms = -1;
+};
 
+//! Exports one object per id at `BUS_PATH/<id>` without a QObject adaptor per
+//! object. Objects are found or created on their first call. BUS_PATH itself
+//! implements org.freedesktop.DBus.ObjectManager. Deleting the tree unregisters it
 template<class Traits>
-bool IsServiceRegistered(Traits = {})
+class ObjectTree : public QDBusVirtualObject
 {
-    return IsServiceRegistered(Traits::dbus_service_name, Traits::connection_type());
-}
+    using Interface = typename Traits::interface;
+    using Export = typename Traits::dbus_export;
+    using Clock = std::chrono::steady_clock;
 
-inline bool WaitForServiceRegistration(const QString &service_name,
-                                       const QDBusConnection &connection)
-{
-    if (IsServiceRegistered(service_name, connection)) {
+public:
+    explicit ObjectTree(ObjectTreeOptions<Interface> options, QObject *parent = nullptr)
+        : QDBusVirtualObject(parent), options_{std::move(options)}, connection_{Traits::connection_type()}
+    {
+        internal::RegisterProxyType<internal::ManagedObjects>();
+        if (options_.idle_timeout_ms >= 0) {
+            QObject::connect(&eviction_timer_, &QTimer::timeout, this, [this] { EvictIdle(); });
+            eviction_timer_.start(qMax(1, options_.idle_timeout_ms / 2));
+        }
+        if (!connection_.registerVirtualObject(Traits::dbus_service_path, this, QDBusConnection::SubPath)) {
+            qWarning() << "Cannot register object tree at path" << Traits::dbus_service_path;
+            throw Exception{QStringLiteral("Cannot register object tree at path") + Traits::dbus_service_path};
+        }
+        if (!connection_.registerService(Traits::dbus_service_name)) {
+            qWarning() << "Cannot register service" << Traits::dbus_service_name;
+            throw Exception{QStringLiteral("Cannot register service") + Traits::dbus_service_name};
+        }
+    }
+
+    ~ObjectTree() override
+    {
+        connection_.unregisterObject(Traits::dbus_service_path, QDBusConnection::UnregisterTree);
+        QMutexLocker lock{&entries_mutex_};
+        for (auto &entry : entries_) {
+            Drop(entry.second);
+        }
+    }
+
+    //! The object of \a id, found or created if it is not in use. Null when there is none
+    Interface *Object(const QString &id)
+    {
+        {
+            QMutexLocker lock{&entries_mutex_};
+            auto it = entries_.find(id);
+            if (it != entries_.end() && it->second.object) {
+                it->second.last_use = Clock::now();
+                return it->second.object;
+            }
+        }
+        // lookup and factory are user code and run without the lock
+        Entry entry;
+        entry.object = options_.lookup ? options_.lookup(id) : nullptr;
+        if (!entry.object && options_.factory) {
+            entry.object = options_.factory(id);
+            entry.owned = true;
+        }
+        if (!entry.object) {
+            return nullptr;
+        }
+        entry.last_use = Clock::now();
+        entry.relays = Export::RelaySignals(entry.object, Path(id), connection_);
+        QMutexLocker lock{&entries_mutex_};
+        auto &slot = entries_[id];
+        if (slot.object) {
+            // another thread made it meanwhile
+            Drop(entry);
+        } else {
+            Drop(slot);
+            slot = std::move(entry);
+        }
+        slot.last_use = Clock::now();
+        return slot.object;
+    }
+
+    //! Forgets the object of \a id, deleting it if the factory created it
+    void Evict(const QString &id)
+    {
+        QMutexLocker lock{&entries_mutex_};
+        auto it = entries_.find(id);
+        if (it != entries_.end()) {
+            Drop(it->second);
+            entries_.erase(it);
+        }
+    }
+
+    //! Called in the thread of the connection
+    QString introspect(const QString &path) const override
+    {
+        const QString root = Traits::dbus_service_path;
+        if (path != root) {
+            return Exists(path.mid(root.size() + 1)) ? Export::IntrospectionXml() : QString{};
+        }
+        auto xml = QStringLiteral("<interface name=\"%1\">"
+                                  "<method name=\"GetManagedObjects\">"
+                                  "<arg type=\"a{oa{sa{sv}}}\" direction=\"out\"/>"
+                                  "</method></interface>")
+                       .arg(internal::ObjectManagerInterface());
+        for (const auto &id : Ids()) {
+            xml += QStringLiteral("<node name=\"%1\"/>").arg(id);
+        }
+        return xml;
+    }
+
+    //! Called in the thread of the connection, so the call is served in the
+    //! thread of the tree
+    bool handleMessage(const QDBusMessage &message, const QDBusConnection &connection) override
+    {
+        if (thread() != QThread::currentThread()) {
+            QMetaObject::invokeMethod(this, [=] { Handle(message, connection); }, Qt::QueuedConnection);
+            return true;
+        }
+        Handle(message, connection);
         return true;
     }
 
-    QDBusServiceWatcher watcher(service_name, connection);
-    QEventLoop loop;
-    QObject::connect(&watcher, &QDBusServiceWatcher::serviceRegistered, &loop, &QEventLoop::quit);
-    loop.exec();
-    return true;
-}
+private:
+    struct Entry
+    {
+        QPointer<Interface> object;
+        bool owned = false;
+        Clock::time_point last_use;
+        internal::SignalRelays relays;
+    };
+
+    static QString Path(const QString &id) { return QString{Traits::dbus_service_path} + QLatin1Char('/') + id; }
+
+    //! Whether \a id has an object, or would get one on its first call
+    bool Exists(const QString &id) const
+    {
+        if (id.isEmpty() || id.contains(QLatin1Char('/'))) {
+            return false;
+        }
+        if (options_.factory || Ids().contains(id)) {
+            return true;
+        }
+        return options_.lookup && options_.lookup(id);
+    }
+
+    void Handle(const QDBusMessage &message, const QDBusConnection &connection)
+    {
+        const QString root = Traits::dbus_service_path;
+        if (message.path() == root) {
+            Respond(message, connection, [&] { return RootReply(message); });
+            return;
+        }
+        auto object = Object(message.path().mid(root.size() + 1));
+        if (object && object->thread() != QThread::currentThread()) {
+            // objects are only called in their own thread
+            auto streams = stream_threads_;
+            auto answered = std::make_shared<bool>(false);
+            // dropped with the queued call when the object goes away first
+            std::shared_ptr<void> abandoned{nullptr, [message, connection, answered](void *) {
+                                                if (!*answered && message.isReplyRequired()) {
+                                                    connection.send(message.createErrorReply(
+                                                        QDBusError::UnknownObject,
+                                                        QStringLiteral("no object at ") + message.path()));
+                                                }
+                                            }};
+            QMetaObject::invokeMethod(
+                object,
+                [streams, answered, abandoned, object, message, connection] {
+                    *answered = true;
+                    internal::StreamThreads::Scope scope{*streams};
+                    Respond(message, connection, [&] { return Reply(object, message); });
+                },
+                Qt::QueuedConnection);
+            return;
+        }
+        internal::StreamThreads::Scope scope{*stream_threads_};
+        Respond(message, connection, [&] { return Reply(object, message); });
+    }
+
+    //! Sends the arguments made by \a reply, or the error it throws, as the reply to \a message
+    template<class F>
+    static void Respond(const QDBusMessage &message, const QDBusConnection &connection, F reply)
+    {
+        internal::FdTransfer::Scope fds{connection};
+        QDBusMessage response;
+        try {
+            response = message.createReply(reply());
+        } catch (const std::exception &e) {
+            response = message.createErrorReply(QDBusError::Failed, QString::fromUtf8(e.what()));
+        } catch (...) {
+            response = message.createErrorReply(QDBusError::Failed, QStringLiteral("unknown error"));
+        }
+        if (message.isReplyRequired()) {
+            connection.send(response);
+        }
+    }
+
+    QVariantList RootReply(const QDBusMessage &message) const
+    {
+        if (message.member() == QLatin1String("GetManagedObjects")) {
+            return {QVariant::fromValue(ManagedObjects())};
+        }
+        throw Exception{QStringLiteral("unknown function ") + message.member()};
+    }
+
+    static QVariantList Reply(Interface *object, const QDBusMessage &message)
+    {
+        if (!object) {
+            throw Exception{QStringLiteral("no object at ") + message.path()};
+        }
+        if (message.interface() == internal::PropertiesInterface()) {
+            return PropertiesReply(object, message);
+        }
+        if (message.member() == QLatin1String("hardbus_batch")) {
+            const auto args = message.arguments();
+            auto results = internal::RunBatch(internal::ProxyFromVariant<QStringList>(args.value(0)),
+                                              internal::ProxyFromVariant<QVariantList>(args.value(1)),
+                                              [object](const QString &name, const QVariantList &args) {
+                                                  auto reply = Export::InvokeOn(object, name, args);
+                                                  return reply.isEmpty() ? QVariant{QString{}} : reply.first();
+                                              });
+            return {QVariant{results}};
+        }
+        return Export::InvokeOn(object, message.member(), message.arguments());
+    }
+
+    static QVariantList PropertiesReply(Interface *object, const QDBusMessage &message)
+    {
+        const auto properties = Export::Properties(object);
+        if (message.member() == QLatin1String("GetAll")) {
+            return {QVariant{properties}};
+        }
+        const auto name = message.arguments().value(1).toString();
+        if (message.member() != QLatin1String("Get") || !properties.contains(name)) {
+            throw Exception{QStringLiteral("unknown property ") + name};
+        }
+        return {QVariant::fromValue(QDBusVariant{properties.value(name)})};
+    }
+
+    QStringList Ids() const
+    {
+        auto ids = options_.list ? options_.list() : QStringList{};
+        QMutexLocker lock{&entries_mutex_};
+        for (auto &entry : entries_) {
+            if (entry.second.object && !ids.contains(entry.first)) {
+                ids.append(entry.first);
+            }
+        }
+        return ids;
+    }
+
+    internal::ManagedObjects ManagedObjects() const
+    {
+        internal::ManagedObjects objects;
+        for (const auto &id : Ids()) {
+            objects.insert(QDBusObjectPath{Path(id)}, {{Traits::dbus_service_interface, QVariantMap{}}});
+        }
+        return objects;
+    }
+
+    void EvictIdle()
+    {
+        const auto deadline = Clock::now() - std::chrono::milliseconds{options_.idle_timeout_ms};
+        QMutexLocker lock{&entries_mutex_};
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (!it->second.object || it->second.last_use < deadline) {
+                Drop(it->second);
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
 
+    static void Drop(Entry &entry)
+    {
+        for (auto &relay : entry.relays.connections) {
+            QObject::disconnect(relay);
+        }
+        entry.relays = {};
+        if (entry.owned && entry.object) {
+            entry.object->deleteLater();
+        }
+        entry.object = nullptr;
+    }
+
+    ObjectTreeOptions<Interface> options_;
+    QDBusConnection connection_;
+    QTimer eviction_timer_;
+    //! Guards the entries, changed in the thread of the tree and read by introspect
+    mutable QMutex entries_mutex_;
+    std::map<QString, Entry> entries_;
+    //! Shared with the calls queued to the thread of an object
+    std::shared_ptr<internal::StreamThreads> stream_threads_{std::make_shared<internal::StreamThreads>()};
+};
+
+//! Exports the objects of \a options under the service path, see ObjectTree
 template<class Traits>
-bool WaitForServiceRegistration(Traits = {})
+ObjectTree<Traits> *RegisterServiceTree(ObjectTreeOptions<typename Traits::interface> options, Traits = {})
 {
-    return WaitForServiceRegistration(Traits::dbus_service_name, Traits::connection_type());
+    return new ObjectTree<Traits>{std::move(options)};
 }
 
+//! Connects access object \a service to object \a id of a service tree,
+//! waiting for the service at most \a timeout_ms milliseconds (-1 waits forever)
 template<class Traits>
-bool ConnectService(typename Traits::interface *service, Traits = {})
+bool ConnectServiceObject(typename Traits::interface *service, const QString &id, Traits = {}, int timeout_ms = -1)
 {
-    auto service_name = Traits::dbus_service_name;
-    if (!IsServiceRegistered<Traits>()) {
-        qWarning() << "Service" << service_name << "is not registered";
-        return false;
-    }
     auto casted = qobject_cast<typename Traits::access *>(service);
     if (!casted) {
-        qWarning() << "Wrong instance to connect to" << service_name;
+        qWarning() << "Wrong instance to connect to" << Traits::dbus_service_name;
         return false;
     }
-    if (casted->dbus_interface_ != nullptr) {
-        qWarning() << "Can't reconnect previously connected service " << service_name;
+    if (casted->RemoteInterface() || casted->local_interface_) {
+        qWarning() << "Can't reconnect previously connected service " << Traits::dbus_service_name;
         return false;
     }
-    casted->dbus_interface_ = new typename Traits::dbus_import{casted};
+    if (!WaitForServiceRegistration(Traits::dbus_service_name, Traits::connection_type(), timeout_ms)) {
+        return false;
+    }
+    casted->SetObjectPath(QString{Traits::dbus_service_path} + QLatin1Char('/') + id);
+    casted->ConnectRemote();
     return true;
 }
 
+//! Ids of the objects a service tree reports, in one call
 template<class Traits>
-bool WaitAndConnectService(typename Traits::interface *service, Traits traits = {})
+QStringList ListServiceObjects(Traits = {})
 {
-    return WaitForServiceRegistration(traits) && ConnectService(service, traits);
+    internal::RegisterProxyType<internal::ManagedObjects>();
+    auto call = QDBusMessage::createMethodCall(Traits::dbus_service_name,
+                                               Traits::dbus_service_path,
+                                               internal::ObjectManagerInterface(),
+                                               QStringLiteral("GetManagedObjects"));
+    QDBusReply<internal::ManagedObjects> reply = Traits::connection_type().call(call);
+    QStringList ids;
+    if (!reply.isValid()) {
+        qWarning() << "Cannot list objects of" << Traits::dbus_service_name << reply.error().message();
+        return ids;
+    }
+    const int prefix = int(qstrlen(Traits::dbus_service_path)) + 1;
+    for (const auto &path : reply.value().keys()) {
+        ids.append(path.path().mid(prefix));
+    }
+    return ids;
 }
 
-
-/// Exceptions
-class Exception : public std::runtime_error
-{
-    using base = std::runtime_error;
-
-public:
-    using base::base;
-    Exception(const QString &what) : base{what.toStdString()} {}
-};
-
-} // namespace hardbus
-
-///////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////// PRIVATE //////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////////
-
-namespace hardbus
-{
-/// Proxy string conversion
+/// Traffic capture and replay
 namespace internal
 {
-template<class T>
-QString ToProxyString(const T &v)
-{
-    return ::hardbus::ProxyStringConverter<std::decay_t<T>>{}.ToString(v);
-}
+enum : quint32 { traffic_log_magic = 0x48425452 /*HBTR*/, traffic_log_version = 1 };
+} // namespace internal
 
-template<class T>
-T FromProxyString(const QString &v)
+//! Writes the calls an exported service receives to a binary log: for each
+//! call the function, its arrival time, its duration and its proxy arguments.
+//! Arguments without QDataStream operators are left out. Calls of any thread
+//! may be recorded
+class TrafficRecorder
 {
-    return ProxyStringConverter<std::decay_t<T>>{}.FromString(v);
-}
+public:
+    explicit TrafficRecorder(const QString &path) : file_{path}
+    {
+        if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qWarning() << "Cannot record traffic to" << path << file_.errorString();
+            return;
+        }
+        stream_.setDevice(&file_);
+        stream_.setVersion(QDataStream::Qt_5_0);
+        stream_ << quint32(internal::traffic_log_magic) << quint32(internal::traffic_log_version);
+    }
 
-struct FromProxyConverter
-{
-    FromProxyConverter() {}
-    FromProxyConverter(QString v) : v_{std::move(v)} {}
+    bool IsOpen() const { return file_.isOpen(); }
 
-    template<class T>
-    operator T() const
+    void Flush()
+    {
+        QMutexLocker lock{&mutex_};
+        if (file_.isOpen()) {
+            file_.flush();
+        }
+    }
+
+    //! Appends a call of \a function that arrived at \a start and took \a duration_ns
+    void Record(const char *function,
+                std::chrono::steady_clock::time_point start,
+                qint64 duration_ns,
+                const QByteArray &arguments)
     {
-        return FromProxyString<T>(v_);
+        QMutexLocker lock{&mutex_};
+        if (!file_.isOpen()) {
+            return;
+        }
+        stream_ << QByteArray::fromRawData(function, int(qstrlen(function)))
+                << qint64(std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin_).count())
+                << duration_ns << arguments;
     }
 
 private:
-    QString v_;
+    QMutex mutex_;
+    QFile file_;
+    QDataStream stream_;
+    const std::chrono::steady_clock::time_point origin_ = std::chrono::steady_clock::now();
 };
 
-struct ToProxyConverter
+//! How ReplayTraffic sends the recorded calls
+struct ReplayOptions
 {
-    ToProxyConverter() {}
-    template<class T>
-    ToProxyConverter(T v) : v_{ToProxyString(v)}
-    {}
-
-    operator QString() const { return v_; }
-
-private:
-    QString v_;
+    //! Rate relative to the recording, e.g. 10 sends ten times faster.
+    //! 0 sends as fast as possible
+    double speed = 1;
+    //! Calls waiting for their reply at most; further calls wait for one of them
+    int max_in_flight = 256;
+    //! Bus to send the calls on, e.g. a private dbus-daemon, instead of the bus of the service
+    QString bus_address;
+    int timeout_ms = -1;
 };
-} // namespace internal
 
-/// Macro helpers
 namespace internal
 {
-// void overload
-template<class T, class F>
-auto CreaeteFromReturnValueImpl(const F &f)
-    -> std::enable_if_t<std::is_same<void, std::result_of_t<F()>>::value, T>
+template<class P>
+void WriteRecordedValue(QDataStream &stream, const P &v, std::true_type /*streamable*/)
 {
-    f();
-    return {};
+    stream << v;
 }
 
-//non void overload
-template<class T, class F>
-auto CreaeteFromReturnValueImpl(const F &f)
-    -> std::enable_if_t<!std::is_same<void, std::result_of_t<F()>>::value, T>
+template<class P>
+void WriteRecordedValue(QDataStream &, const P &, std::false_type /*streamable*/)
+{}
+
+//! Writes proxy value \a v into a traffic log. Values without QDataStream
+//! operators are left out and replayed default-constructed
+template<class P>
+void WriteRecordedValue(QDataStream &stream, const P &v)
 {
-    return {f()};
+    WriteRecordedValue(stream, v, HasDataStreamOperator<P>{});
 }
 
-//! Create an object \a T from return value of \a f.
-//! Creates default contructed value if \a f returns void
-template<class T, class F>
-T CreaeteFromReturnValue(const F &f)
+inline void WriteRecordedValue(QDataStream &stream, const CompressedPayload &v)
 {
-    return CreaeteFromReturnValueImpl<T>(f);
+    stream << v.compressed << v.data;
 }
 
-template<class RET, class ARG, class F, class T, class... Args>
-RET ProxyCallHelper(F f, T *obj, Args &... str_args)
+template<class P>
+void ReadRecordedValue(QDataStream &stream, P &v, std::true_type /*streamable*/)
 {
-    auto wrapped = [&] { return (obj->*f)(ARG{str_args}...); };
-    return CreaeteFromReturnValue<RET>(wrapped);
+    stream >> v;
 }
 
-template<class... Args>
-auto ProxyCallHelper1(Args &&... args)
+template<class P>
+void ReadRecordedValue(QDataStream &, P &, std::false_type /*streamable*/)
+{}
+
+template<class P>
+void ReadRecordedValue(QDataStream &stream, P &v)
 {
-    return ProxyCallHelper<ToProxyConverter, FromProxyConverter>(std::forward<Args>(args)...);
+    ReadRecordedValue(stream, v, HasDataStreamOperator<P>{});
 }
 
-template<class F, class T, class... Args>
-auto ProxyCallHelper2(F &&f, T *obj, Args &&... args)
+inline void ReadRecordedValue(QDataStream &stream, CompressedPayload &v)
 {
-    if (!obj)
-        throw ::hardbus::Exception{"service not registered"};
-    return ProxyCallHelper<FromProxyConverter, ToProxyConverter>(f,
-                                                                 obj,
-                                                                 std::forward<Args>(
-                                                                     args)...);
+    stream >> v.compressed >> v.data;
 }
 
-template<class... Args>
-QDBusReply<QString> CallFuncOverDBus(const QDBusAbstractInterface *interface,
-                                     const QString &func_name,
-                                     Args &&... str_args)
+#ifdef HARDBUS_ENABLE_FD_TRANSFER
+inline void WriteRecordedValue(QDataStream &stream, const LargePayload &v)
 {
-    QDBusReply<QString> res = const_cast<QDBusAbstractInterface &>(*interface)
-                                  .call(func_name, std::forward<Args>(str_args)...);
-    return res;
+    stream << v.Data();
 }
 
-template<class PROXY, class S, class SF, class T, class TF>
-bool MakeProxyConnector(S *source, SF source_signal, T *target, TF target_signal)
+inline void ReadRecordedValue(QDataStream &stream, LargePayload &v)
 {
-    QObject::connect(source, source_signal, [=](auto &&... args) {
-        emit(target->*target_signal)(PROXY{std::forward<decltype(args)>(args)}...);
-    });
-    return true;
+    QByteArray data;
+    stream >> data;
+    v = LargePayload{std::move(data)};
 }
+#endif
+
+//! A call being served. Recorded, with its duration, once the last copy is gone
+class CallRecording
+{
+public:
+    CallRecording(std::shared_ptr<TrafficRecorder> recorder, const char *function, QByteArray arguments)
+        : recorder_{std::move(recorder)}, function_{function}, arguments_{std::move(arguments)}
+    {}
+
+    ~CallRecording()
+    {
+        recorder_->Record(function_,
+                          start_,
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                                                                               - start_)
+                              .count(),
+                          arguments_);
+    }
+
+private:
+    std::shared_ptr<TrafficRecorder> recorder_;
+    const char *function_;
+    QByteArray arguments_;
+    const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+};
 
+//! Starts recording a call of \a function with proxy arguments \a args, if there is a recorder
 template<class... Args>
-auto MakeProxyConnector1(Args &&... args)
+std::shared_ptr<CallRecording> RecordCall(const std::shared_ptr<TrafficRecorder> &recorder,
+                                          const char *function,
+                                          const Args &... args)
 {
-    return MakeProxyConnector<FromProxyConverter>(std::forward<Args>(args)...);
+    if (!recorder) {
+        return nullptr;
+    }
+    QByteArray arguments;
+    QDataStream stream{&arguments, QIODevice::WriteOnly};
+    stream.setVersion(QDataStream::Qt_5_0);
+    int expand[] = {0, (WriteRecordedValue(stream, args), 0)...};
+    Q_UNUSED(expand);
+    return std::make_shared<CallRecording>(recorder, function, std::move(arguments));
 }
 
-template<class... Args>
-auto MakeProxyConnector2(Args &&... args)
+template<class P>
+QVariant ReadRecordedArgument(QDataStream &stream)
 {
-    return MakeProxyConnector<ToProxyConverter>(std::forward<Args>(args)...);
+    P v;
+    ReadRecordedValue(stream, v);
+    return QVariant::fromValue(v);
 }
 
-template<typename T, typename R, typename... Args>
-R DeduceReturnType(R (T::*mf)(Args...));
+//! Proxy arguments \a Ps of a recorded call, as message arguments
+template<class... Ps>
+QVariantList ReadRecordedArguments(const QByteArray &data)
+{
+    QDataStream stream{data};
+    stream.setVersion(QDataStream::Qt_5_0);
+    return {ReadRecordedArgument<Ps>(stream)...};
+}
 
-template<typename T, typename R, typename... Args>
-R DeduceReturnType(R (T::*mf)(Args...) const);
+//! Recorded call ready to be sent again
+struct RecordedCall
+{
+    QVariantList arguments;
+    bool oneway = false;
+};
 
-inline void ExportAdaptor(QObject *parent,
-                          QDBusConnection connection,
-                          QString object_path,
-                          QString service_name)
+struct TrafficRecord
 {
-    if (!connection.registerObject(object_path, parent)) {
-        qWarning() << "Cannot register object at path" << object_path;
-        throw ::hardbus::Exception{"Cannot register object at path" + object_path};
+    QByteArray function;
+    qint64 start_ns = 0;
+    qint64 duration_ns = 0;
+    QByteArray arguments;
+};
+
+inline std::vector<TrafficRecord> ReadTrafficLog(const QString &path)
+{
+    QFile file{path};
+    if (!file.open(QIODevice::ReadOnly)) {
+        throw Exception{QStringLiteral("Cannot read traffic log ") + path};
     }
-    if (!connection.registerService(service_name)) {
-        qWarning() << "Cannot register service" << service_name;
-        throw ::hardbus::Exception{"Cannot register service" + object_path};
+    QDataStream stream{&file};
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0;
+    quint32 version = 0;
+    stream >> magic >> version;
+    if (magic != traffic_log_magic || version != traffic_log_version) {
+        throw Exception{QStringLiteral("Not a traffic log ") + path};
     }
+    std::vector<TrafficRecord> records;
+    while (!stream.atEnd()) {
+        TrafficRecord record;
+        stream >> record.function >> record.start_ns >> record.duration_ns >> record.arguments;
+        if (stream.status() != QDataStream::Ok) {
+            qWarning() << "Traffic log is truncated" << path;
+            break;
+        }
+        records.push_back(std::move(record));
+    }
+    return records;
 }
+} // namespace internal
 
-template <class R, class F>
-void ReturnValueOrVoid(const F &f, std::true_type)
+//! Sends the calls of traffic log \a log_path to the service of \a Traits
+//! again, at the recorded rate scaled by `options.speed`. Reports the
+//! throughput and the latency of the replies, and the recorded durations
+template<class Traits>
+QJsonObject ReplayTraffic(const QString &log_path, ReplayOptions options = {}, Traits = {})
 {
-    f();
+    using Export = typename Traits::dbus_export;
+    using Clock = std::chrono::steady_clock;
+    const auto records = internal::ReadTrafficLog(log_path);
+    auto connection = options.bus_address.isEmpty()
+                          ? Traits::connection_type()
+                          : QDBusConnection::connectToBus(options.bus_address, QStringLiteral("hardbus_replay"));
+    if (!connection.isConnected()) {
+        throw Exception{QStringLiteral("Cannot connect to bus ") + options.bus_address};
+    }
+
+    Histogram latency;
+    Histogram recorded;
+    quint64 errors = 0;
+    int in_flight = 0;
+    QHash<QByteArray, QDBusMessage> templates;
+    // recorded payloads are read back for this connection
+    internal::FdTransfer::Scope fds{connection};
+    QEventLoop loop;
+    const auto start = Clock::now();
+    const auto first_ns = records.empty() ? 0 : records.front().start_ns;
+    for (const auto &record : records) {
+        recorded.Record(record.duration_ns);
+        if (options.speed > 0) {
+            const auto due = start + std::chrono::nanoseconds{qint64((record.start_ns - first_ns) / options.speed)};
+            for (auto now = Clock::now(); now < due; now = Clock::now()) {
+                const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count();
+                QTimer::singleShot(int(wait), Qt::PreciseTimer, &loop, [&loop] { loop.quit(); });
+                loop.exec();
+            }
+        }
+        while (in_flight >= options.max_in_flight) {
+            loop.exec();
+        }
+        internal::RecordedCall call;
+        try {
+            call = Export::ReadRecordedCall(QString::fromLatin1(record.function), record.arguments);
+        } catch (const std::exception &e) {
+            qWarning() << "Cannot replay" << record.function << e.what();
+            ++errors;
+            continue;
+        }
+        auto it = templates.find(record.function);
+        if (it == templates.end()) {
+            it = templates.insert(record.function,
+                                  QDBusMessage::createMethodCall(Traits::dbus_service_name,
+                                                                 Traits::dbus_service_path,
+                                                                 Traits::dbus_service_interface,
+                                                                 QString::fromLatin1(record.function)));
+        }
+        auto message = *it;
+        message.setArguments(call.arguments);
+        if (call.oneway) {
+            if (!connection.send(message)) {
+                ++errors;
+            }
+            continue;
+        }
+        const auto sent = Clock::now();
+        ++in_flight;
+        auto watcher = new QDBusPendingCallWatcher{connection.asyncCall(message, options.timeout_ms)};
+        QObject::connect(watcher, &QDBusPendingCallWatcher::finished, &loop, [&, sent, watcher] {
+            latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent).count());
+            if (watcher->isError()) {
+                ++errors;
+            }
+            --in_flight;
+            watcher->deleteLater();
+            loop.quit();
+        });
+    }
+    while (in_flight > 0) {
+        loop.exec();
+    }
+    if (!options.bus_address.isEmpty()) {
+        QDBusConnection::disconnectFromBus(QStringLiteral("hardbus_replay"));
+    }
+
+    const auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    return {{QStringLiteral("calls"), double(records.size())},
+            {QStringLiteral("errors"), double(errors)},
+            {QStringLiteral("seconds"), seconds},
+            {QStringLiteral("calls_per_second"), seconds > 0 ? records.size() / seconds : 0.0},
+            {QStringLiteral("latency"), latency.ToJson()},
+            {QStringLiteral("recorded_duration"), recorded.ToJson()}};
 }
 
-template <class R, class F>
-R ReturnValueOrVoid(const F &f, std::false_type)
+//! Command line replay tool, see HARDBUS_DEFINE_REPLAY_MAIN
+template<class Traits>
+int RunTrafficReplay(const QStringList &args, Traits = {})
 {
-    return f();
-}
+    const auto usage = [&] {
+        qWarning().noquote() << "usage:" << args.value(0)
+                             << "<traffic log> [--speed <factor> | --max] [--bus <address>] [--output <file>]";
+        return 2;
+    };
+    const auto value_of = [&](const char *option) {
+        const int index = args.indexOf(QLatin1String(option));
+        return index > 0 ? args.value(index + 1) : QString{};
+    };
+    if (args.size() < 2 || args.at(1).startsWith(QLatin1String("--"))) {
+        return usage();
+    }
+    ReplayOptions options;
+    if (args.contains(QStringLiteral("--max"))) {
+        options.speed = 0;
+    } else if (!value_of("--speed").isEmpty()) {
+        bool ok = false;
+        options.speed = value_of("--speed").toDouble(&ok);
+        if (!ok || options.speed <= 0) {
+            return usage();
+        }
+    }
+    options.bus_address = value_of("--bus");
 
-} // namespace internal
+    QJsonObject report;
+    try {
+        report = ReplayTraffic<Traits>(args.at(1), options);
+    } catch (const std::exception &e) {
+        qWarning() << e.what();
+        return 1;
+    }
+    const auto json = QJsonDocument{report}.toJson();
+    const auto output = value_of("--output");
+    if (output.isEmpty()) {
+        QTextStream{stdout} << json;
+        return 0;
+    }
+    QFile file{output};
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot write" << output;
+        return 1;
+    }
+    file.write(json);
+    return 0;
+}
 
 } // namespace hardbus
 
@@ -358,6 +4328,69 @@ R ReturnValueOrVoid(const F &f, std::false_type)
 ///////////////////////////////////////////////////////////////////////////////////
 
 //////
+//! \a API is a tuple of the number of macros the API macro takes and the macro
+#define HARDBUS_INTERNAL_DEFINE_SERVICE_(TAG, INTERFACE, API, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
+    struct TAG \
+    { \
+        HARDBUS_INTERNAL_DEFINE_TRAITS_( \
+            TAG, INTERFACE, BUS_SERVICE, BUS_PATH, BUS_INTERFACE, BUS_TYPE) \
+        HARDBUS_INTERNAL_DEFINE_STATS_ADAPTOR_(TAG, BUS_INTERFACE) \
+        HARDBUS_INTERNAL_DEFINE_EXPORT_ADAPTOR_(TAG, BUS_INTERFACE, API) \
+        HARDBUS_INTERNAL_DEFINE_IMPORT_ADAPTOR_(TAG, API) \
+        HARDBUS_INTERNAL_DEFINE_ACCESS_ADAPTOR_(TAG, API) \
+        using Access = AccessFor##TAG; \
+        static const char *ServiceName() {return BUS_SERVICE;} \
+        static const char *ServicePath() {return BUS_PATH;} \
+        static const char *ServiceInterface() {return BUS_INTERFACE;} \
+        static QDBusConnection Connection() {return BUS_TYPE;} \
+        static ::hardbus::ServiceMetrics &Metrics() {return ::hardbus::internal::MetricsFor<TraitsFor##TAG>();} \
+        static void RegisterService(INTERFACE *service, ::hardbus::ExportOptions options = {}) \
+        { \
+            new ExporAdaptorFor##TAG(service, options); \
+        } \
+        static INTERFACE *CreateServiceInterface(QObject *parent = nullptr) \
+        { \
+            return new AccessFor##TAG{parent}; \
+        } \
+        static bool WaitAndConnectService(INTERFACE *service, int timeout_ms = -1) \
+        { \
+            return hardbus::WaitForServiceRegistration<TraitsFor##TAG>({}, timeout_ms) \
+                   && ::hardbus::internal::ConnectAccess<TraitsFor##TAG>(service); \
+        } \
+        static void ConnectServiceAsync(INTERFACE *service, int timeout_ms, std::function<void(bool)> callback) \
+        { \
+            ::hardbus::ConnectServiceAsync<TraitsFor##TAG>(service, timeout_ms, std::move(callback)); \
+        } \
+        static INTERFACE *CreateAndConnectService(QObject *parent = nullptr) \
+        { \
+            auto service = CreateServiceInterface(parent); \
+            WaitAndConnectService(service);\
+            return service; \
+        } \
+        static ::hardbus::ObjectTree<TraitsFor##TAG> *RegisterServiceTree(::hardbus::ObjectTreeOptions<INTERFACE> options) \
+        { \
+            return ::hardbus::RegisterServiceTree<TraitsFor##TAG>(std::move(options)); \
+        } \
+        static bool ConnectServiceObject(INTERFACE *service, const QString &id, int timeout_ms = -1) \
+        { \
+            return ::hardbus::ConnectServiceObject<TraitsFor##TAG>(service, id, {}, timeout_ms); \
+        } \
+        static QStringList ListServiceObjects() \
+        { \
+            return ::hardbus::ListServiceObjects<TraitsFor##TAG>(); \
+        } \
+        static QJsonObject ReplayTraffic(const QString &log_path, ::hardbus::ReplayOptions options = {}) \
+        { \
+            return ::hardbus::ReplayTraffic<TraitsFor##TAG>(log_path, std::move(options)); \
+        } \
+    };
+
+//! Expands \a API with FUNC, SIG and PROP, or FUNC and SIG only when it takes two macros
+#define HARDBUS_INTERNAL_API_(API, FUNC, SIG, PROP) \
+    BOOST_PP_CAT(HARDBUS_INTERNAL_API_, BOOST_PP_TUPLE_ELEM(0, API))(BOOST_PP_TUPLE_ELEM(1, API), FUNC, SIG, PROP)
+#define HARDBUS_INTERNAL_API_2(API, FUNC, SIG, PROP) API(FUNC, SIG)
+#define HARDBUS_INTERNAL_API_3(API, FUNC, SIG, PROP) API(FUNC, SIG, PROP)
+
 #define HARDBUS_INTERNAL_DEFINE_TRAITS_(TAG, \
                                         INTERFACE, \
                                         BUS_SERVICE, \
@@ -378,6 +4411,27 @@ R ReturnValueOrVoid(const F &f, std::false_type)
 
 //////
 
+#define HARDBUS_INTERNAL_DEFINE_STATS_ADAPTOR_(TAG, BUS_INTERFACE) \
+    class StatsAdaptorFor##TAG : public QDBusAbstractAdaptor \
+    { \
+        W_OBJECT(StatsAdaptorFor##TAG) \
+        W_CLASSINFO("D-Bus Interface", BUS_INTERFACE ".Stats") \
+\
+    public: \
+        explicit StatsAdaptorFor##TAG(QObject *object) : QDBusAbstractAdaptor(object) {} \
+        /* Metrics of the service as JSON */ \
+        QString Report() \
+        { \
+            const auto json = ::hardbus::internal::MetricsFor<TraitsFor##TAG>().ToJson(); \
+            return QString::fromUtf8(QJsonDocument{json}.toJson(QJsonDocument::Compact)); \
+        } \
+        W_SLOT(Report) \
+        void Reset() { ::hardbus::internal::MetricsFor<TraitsFor##TAG>().Reset(); } \
+        W_SLOT(Reset) \
+    };
+
+//////
+
 #define HARDBUS_INTERNAL_DEFINE_EXPORT_ADAPTOR_(TAG, BUS_INTERFACE, API) \
     class ExporAdaptorFor##TAG : public QDBusAbstractAdaptor \
     { \
@@ -387,40 +4441,283 @@ R ReturnValueOrVoid(const F &f, std::false_type)
         using Tag = TraitsFor##TAG; \
         using Interface = typename Tag::interface; \
         using Self = ExporAdaptorFor##TAG; \
+        static bool RegisterProxyTypes() \
+        { \
+            HARDBUS_INTERNAL_API_(API, \
+                                  HARDBUS_INTERNAL_REGISTER_PROXY_TYPES_, \
+                                  HARDBUS_INTERNAL_REGISTER_SIGNAL_PROXY_TYPES_, \
+                                  HARDBUS_INTERNAL_REGISTER_PROPERTY_PROXY_TYPE_) \
+            return true; \
+        } \
+        bool proxy_types_registered_{RegisterProxyTypes()}; \
         Interface *interface_; \
+        QDBusConnection connection_; \
+        ::hardbus::ExportOptions options_; \
+        QDBusServer *server_{nullptr}; \
+        /* Destroyed after the dispatcher, which waits for the calls running in the pool */ \
+        /* and fails the queued ones, so no call starts a stream anymore */ \
+        ::hardbus::internal::StreamThreads stream_threads_; \
+        std::unique_ptr<::hardbus::internal::ExportDispatcher> dispatcher_; \
+\
+        void ListenForPeers() \
+        { \
+            server_ = new QDBusServer{options_.peer_address, this}; \
+            if (!server_->isConnected()) { \
+                qWarning() << "Cannot listen for peers on" << options_.peer_address \
+                           << server_->lastError().message(); \
+                return; \
+            } \
+            QObject::connect(server_, &QDBusServer::newConnection, this, [this](QDBusConnection peer) { \
+                auto object = new QObject{interface_}; \
+                new Self{interface_, object, peer, QString{}, options_}; \
+                peer.connect(QString{}, \
+                             QStringLiteral("/org/freedesktop/DBus/Local"), \
+                             QStringLiteral("org.freedesktop.DBus.Local"), \
+                             QStringLiteral("Disconnected"), \
+                             object, \
+                             SLOT(deleteLater())); \
+            }); \
+        } \
 \
     public: \
-        ExporAdaptorFor##TAG(Interface *interface) \
-            : QDBusAbstractAdaptor(interface), interface_{interface} \
+        ExporAdaptorFor##TAG(Interface *interface, ::hardbus::ExportOptions options = {}) \
+            : ExporAdaptorFor##TAG( \
+                interface, interface, Tag::connection_type(), Tag::dbus_service_name, options) \
+        {} \
+        /* Exports \a interface registering \a object on \a connection */ \
+        ExporAdaptorFor##TAG(Interface *interface, \
+                             QObject *object, \
+                             QDBusConnection connection, \
+                             QString service_name, \
+                             ::hardbus::ExportOptions options) \
+            : QDBusAbstractAdaptor(object), interface_{interface}, connection_{connection}, \
+              options_{std::move(options)} \
         { \
-            Q_UNUSED(interface_); \
             setAutoRelaySignals(false); \
-            ::hardbus::internal::ExportAdaptor(interface_, \
-                                               Tag::connection_type(), \
+            if (options_.dispatch_pool) { \
+                dispatcher_.reset(new ::hardbus::internal::ExportDispatcher{options_.dispatch_pool}); \
+            } \
+            if (options_.stats) { \
+                new StatsAdaptorFor##TAG{object}; \
+            } \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_EXPORT_PROPERTY_RELAY_) \
+            ::hardbus::internal::ExportAdaptor(object, \
+                                               connection_, \
                                                Tag::dbus_service_path, \
-                                               Tag::dbus_service_name); \
+                                               service_name); \
+            if (object == interface_) { \
+                ::hardbus::internal::LocalServices<Tag>::Set(interface_); \
+                if (options_.peer_to_peer) { \
+                    ListenForPeers(); \
+                } \
+            } \
+        } \
+        ~ExporAdaptorFor##TAG() \
+        { \
+            if (parent() == interface_) { \
+                ::hardbus::internal::LocalServices<Tag>::Reset(interface_); \
+            } \
+        } \
+        QString hardbus_peer_address() { return server_ ? server_->address() : QString{}; } \
+        W_SLOT(hardbus_peer_address) \
+        /* Runs the calls of a batch in order, replying with a list of */ \
+        /* the error message and the return value of each call */ \
+        QVariantList hardbus_batch(const QStringList &functions, const QVariantList &arguments) \
+        { \
+            return ::hardbus::internal::RunBatch(functions, \
+                                                 arguments, \
+                                                 [this](const QString &name, const QVariantList &args) { \
+                                                     return InvokeByName(name, args); \
+                                                 }); \
+        } \
+        W_SLOT(hardbus_batch) \
+        QVariant InvokeByName(const QString &name, const QVariantList &args) \
+        { \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_EXPORT_INVOKE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_) \
+            throw ::hardbus::Exception{QStringLiteral("unknown function ") + name}; \
+        } \
+        /* Calls \a name of \a object, an object of a service tree, returning */ \
+        /* the arguments of the reply */ \
+        static QVariantList InvokeOn(Interface *object, const QString &name, const QVariantList &args) \
+        { \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_TREE_INVOKE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_) \
+            throw ::hardbus::Exception{QStringLiteral("unknown function ") + name}; \
+        } \
+        /* Values of the properties of \a object, an object of a service tree */ \
+        static QVariantMap Properties(Interface *object) \
+        { \
+            Q_UNUSED(object); \
+            QVariantMap properties; \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_TREE_PROPERTY_) \
+            return properties; \
+        } \
+        /* Call of \a name recorded by a TrafficRecorder, read back from \a arguments */ \
+        static ::hardbus::internal::RecordedCall ReadRecordedCall(const QString &name, const QByteArray &arguments) \
+        { \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_EXPORT_RECORDED_CALL_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_) \
+            throw ::hardbus::Exception{QStringLiteral("unknown function ") + name}; \
+        } \
+        static QString IntrospectionXml() \
+        { \
+            auto xml = QStringLiteral("<interface name=\"%1\">").arg(QLatin1String(Tag::dbus_service_interface)); \
+            HARDBUS_INTERNAL_API_(API, \
+                                  HARDBUS_INTERNAL_TREE_INTROSPECT_FUNC_, \
+                                  HARDBUS_INTERNAL_TREE_INTROSPECT_SIGNAL_, \
+                                  HARDBUS_INTERNAL_TREE_INTROSPECT_PROPERTY_) \
+            return xml + QStringLiteral("</interface>"); \
+        } \
+        /* Sends the signals of \a object as signals of \a path, emitted as their specs say */ \
+        static ::hardbus::internal::SignalRelays RelaySignals(Interface *object, \
+                                                              const QString &path, \
+                                                              const QDBusConnection &connection) \
+        { \
+            ::hardbus::internal::SignalRelays relays; \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_TREE_RELAY_SIGNAL_, HARDBUS_INTERNAL_TREE_RELAY_PROPERTY_) \
+            return relays; \
         } \
     public: \
-        API(HARDBUS_INTERNAL_EXPORT_FUNC_, HARDBUS_INTERNAL_EXPORT_SIGNAL_) \
+        HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_EXPORT_FUNC_, HARDBUS_INTERNAL_EXPORT_SIGNAL_, HARDBUS_INTERNAL_EXPORT_PROPERTY_) \
     };
 
-#define HARDBUS_INTERNAL_EXPORT_SIGNAL_(OUT, FUNC, ARGS) \
-    OUT FUNC(HARDBUS_INTERNAL_TO_STRING_ARGS_ ARGS) HARDBUS_INTERNAL_W_SIGNAL(FUNC, ARGS) \
-        private : bool connectror_for_##FUNC \
-                  = ::hardbus::internal::MakeProxyConnector2(interface_, \
-                                                             &Interface::FUNC, \
-                                                             this, \
-                                                             &Self::FUNC);
+#define HARDBUS_INTERNAL_EXPORT_SIGNAL_(OUT, FUNC, ARGS, ...) \
+    HARDBUS_INTERNAL_SIGNAL_DECL_(OUT, FUNC, ARGS, __VA_ARGS__) \
+\
+    private: \
+    HARDBUS_INTERNAL_SIGNAL_EMISSION_(__VA_ARGS__) emission_of_##FUNC; \
+    QMetaObject::Connection connectror_for_##FUNC \
+        = emission_of_##FUNC.Connect(::hardbus::internal::MetricsFor<Tag>().Export(#FUNC), \
+                                     interface_, \
+                                     &Interface::FUNC, \
+                                     this, \
+                                     &Self::FUNC, \
+                                     connection_); \
+\
+    public:
+
+/* Properties are read-only, QtDBus serves their Get and GetAll */
+#define HARDBUS_INTERNAL_EXPORT_PROPERTY_(TYPE, NAME) \
+    private: \
+    using hardbus_property_type_of_##NAME = ::hardbus::internal::ProxyType<W_MACRO_REMOVEPAREN(TYPE)>; \
+\
+    public: \
+    hardbus_property_type_of_##NAME hardbus_property_##NAME() const \
+    { \
+        ::hardbus::internal::FdTransfer::Scope fds{connection_}; \
+        return ::hardbus::internal::ToProxyConverter{}(interface_->NAME()); \
+    } \
+    W_PROPERTY(hardbus_property_type_of_##NAME, NAME READ hardbus_property_##NAME)
+
+#define HARDBUS_INTERNAL_EXPORT_PROPERTY_RELAY_(TYPE, NAME) \
+    ::hardbus::internal::RelayPropertyChanges( \
+        this, \
+        interface_, \
+        &Interface::NAME##Changed, \
+        Tag::dbus_service_interface, \
+        #NAME, \
+        [interface = interface_] { return QVariant::fromValue(::hardbus::internal::ToProxyConverter{}(interface->NAME())); }, \
+        Tag::dbus_service_path, \
+        connection_);
+
+#define HARDBUS_INTERNAL_EXPORT_RECORDED_CALL_(OUT, FUNC, ARGS, ...) \
+    if (name == QLatin1String(#FUNC)) { \
+        return {::hardbus::internal::ReadRecordedArguments<HARDBUS_INTERNAL_TO_METHOD_PROXY_TYPES_( \
+                    HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), ARGS)>(arguments), \
+                HARDBUS_INTERNAL_HAS_SPEC_(ONEWAY, __VA_ARGS__) == 1}; \
+    }
+
+#define HARDBUS_INTERNAL_EXPORT_INVOKE_(OUT, FUNC, ...) \
+    if (name == QLatin1String(#FUNC)) { \
+        return ::hardbus::internal::InvokeFromVariants(this, &Self::FUNC, args); \
+    }
+
+#define HARDBUS_INTERNAL_TREE_INVOKE_(OUT, FUNC, ARGS, ...) \
+    if (name == QLatin1String(#FUNC)) { \
+        static auto &metrics = ::hardbus::internal::MetricsFor<Tag>().Export(#FUNC); \
+        return ::hardbus::internal::Measure(metrics, &metrics.implementation, [&] { \
+            return ::hardbus::internal::InvokeWithProxies<HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)>( \
+                object, &Interface::FUNC, args); \
+        }); \
+    }
+
+#define HARDBUS_INTERNAL_TREE_INTROSPECT_FUNC_(OUT, FUNC, ARGS, ...) \
+    xml += ::hardbus::internal::IntrospectMethod<HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)>(#FUNC, \
+                                                                                             &Interface::FUNC);
+
+#define HARDBUS_INTERNAL_TREE_INTROSPECT_SIGNAL_(OUT, FUNC, ARGS, ...) \
+    xml += ::hardbus::internal::IntrospectSignal(HARDBUS_INTERNAL_IS_BATCHED_(__VA_ARGS__){}, \
+                                                 #FUNC, \
+                                                 &Interface::FUNC);
+
+#define HARDBUS_INTERNAL_TREE_PROPERTY_(TYPE, NAME) \
+    properties.insert(QStringLiteral(#NAME), QVariant::fromValue(::hardbus::internal::ToProxyConverter{}(object->NAME())));
+
+#define HARDBUS_INTERNAL_TREE_INTROSPECT_PROPERTY_(TYPE, NAME) \
+    xml += ::hardbus::internal::IntrospectProperty<W_MACRO_REMOVEPAREN(TYPE)>(#NAME);
+
+#define HARDBUS_INTERNAL_TREE_RELAY_PROPERTY_(TYPE, NAME) \
+    relays.connections.push_back(::hardbus::internal::RelayPropertyChanges( \
+        object, \
+        object, \
+        &Interface::NAME##Changed, \
+        Tag::dbus_service_interface, \
+        #NAME, \
+        [object] { return QVariant::fromValue(::hardbus::internal::ToProxyConverter{}(object->NAME())); }, \
+        path, \
+        connection));
+
+#define HARDBUS_INTERNAL_TREE_RELAY_SIGNAL_(OUT, FUNC, ARGS, ...) \
+    { \
+        auto emission = std::make_shared<HARDBUS_INTERNAL_SIGNAL_EMISSION_(__VA_ARGS__)>(); \
+        relays.connections.push_back(emission->Relay( \
+            ::hardbus::internal::MetricsFor<Tag>().Export(#FUNC), \
+            object, \
+            &Interface::FUNC, \
+            QDBusMessage::createSignal(path, QLatin1String(Tag::dbus_service_interface), QStringLiteral(#FUNC)), \
+            connection)); \
+        relays.emissions.push_back(std::move(emission)); \
+    }
 
 #define HARDBUS_INTERNAL_EXPORT_FUNC_(OUT, FUNC, ARGS, ...) \
-    QString FUNC(HARDBUS_INTERNAL_TO_STRING_ARGS_ ARGS) \
+    ::hardbus::internal::ExportReturnType<W_MACRO_REMOVEPAREN(OUT), \
+                                          HARDBUS_INTERNAL_IS_ONEWAY_(__VA_ARGS__), \
+                                          HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)> \
+    FUNC(HARDBUS_INTERNAL_TO_METHOD_PROXY_ARGS_(HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), ARGS) \
+             HARDBUS_INTERNAL_COMMA_IF_ARGS_(ARGS) const QDBusMessage &message) \
     { \
+        using R = decltype(::hardbus::internal::DeduceReturnType(&Self::FUNC)); \
+        using TO = ::hardbus::internal::MethodToProxyConverter<HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)>; \
+        static auto &metrics = ::hardbus::internal::MetricsFor<Tag>().Export(#FUNC); \
+        const auto recording = ::hardbus::internal::RecordCall( \
+            options_.recorder, #FUNC HARDBUS_INTERNAL_COMMA_IF_ARGS_(ARGS) HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+        if (dispatcher_ && message.type() == QDBusMessage::MethodCallMessage) { \
+            dispatcher_->Dispatch(message, \
+                                  connection_, \
+                                  #FUNC, \
+                                  HARDBUS_INTERNAL_HAS_SPEC_(CONCURRENT, __VA_ARGS__), \
+                                  [=]() mutable { \
+                                      Q_UNUSED(recording); \
+                                      ::hardbus::internal::StreamThreads::Scope streams{stream_threads_}; \
+                                      ::hardbus::internal::FdTransfer::Scope fds{connection_}; \
+                                      auto helper = [&](auto &&... args) { \
+                                          return ::hardbus::internal::ProxyCallHelper1<TO>( \
+                                              &Interface::FUNC, interface_, HARDBUS_FWD(args)...); \
+                                      }; \
+                                      return ::hardbus::internal::Measure(metrics, &metrics.implementation, [&] { \
+                                          return static_cast<R>(helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS)); \
+                                      }); \
+                                  }); \
+            return R(); \
+        } \
+        ::hardbus::internal::StreamThreads::Scope streams{stream_threads_}; \
+        ::hardbus::internal::FdTransfer::Scope fds{connection_}; \
         auto helper = [&](auto &&... args) { \
-            return ::hardbus::internal::ProxyCallHelper1(&Interface::FUNC, \
-                                                         interface_, \
-                                                         HARDBUS_FWD(args)...); \
+            return ::hardbus::internal::ProxyCallHelper1<TO>(&Interface::FUNC, \
+                                                             interface_, \
+                                                             HARDBUS_FWD(args)...); \
         }; \
-        return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+        return ::hardbus::internal::Measure(metrics, &metrics.implementation, [&] { \
+            return static_cast<R>(helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS)); \
+        }); \
     } \
     W_SLOT(FUNC)
 //////
@@ -433,40 +4730,112 @@ R ReturnValueOrVoid(const F &f, std::false_type)
         using Tag = TraitsFor##TAG; \
         using Interface = Tag::interface; \
         using Self = ImportAdaptorFor##TAG; \
+        static bool RegisterProxyTypes() \
+        { \
+            HARDBUS_INTERNAL_API_(API, \
+                                  HARDBUS_INTERNAL_REGISTER_PROXY_TYPES_, \
+                                  HARDBUS_INTERNAL_REGISTER_SIGNAL_PROXY_TYPES_, \
+                                  HARDBUS_INTERNAL_REGISTER_PROPERTY_PROXY_TYPE_) \
+            return true; \
+        } \
+        bool proxy_types_registered_{RegisterProxyTypes()}; \
         Interface *interface_; \
+        std::function<void(const QVariantMap &)> properties_changed_; \
 \
     public: \
         explicit ImportAdaptorFor##TAG(Interface *interface) \
-            : QDBusAbstractInterface(Tag::dbus_service_name, \
-                                     Tag::dbus_service_path, \
+            : ImportAdaptorFor##TAG(interface, Tag::dbus_service_name, Tag::connection_type()) \
+        {} \
+        /* Peer-to-peer connections have no service name */ \
+        ImportAdaptorFor##TAG(Interface *interface, \
+                              const QString &service_name, \
+                              const QDBusConnection &connection, \
+                              const QString &object_path = Tag::dbus_service_path) \
+            : QDBusAbstractInterface(service_name, \
+                                     object_path, \
                                      Tag::dbus_service_interface, \
-                                     Tag::connection_type(), \
+                                     connection, \
                                      interface), \
               interface_{interface} \
         { \
             Q_UNUSED(interface_); \
         } \
+        /* Calls \a changed with the values of properties the service reports changed */ \
+        void WatchProperties(std::function<void(const QVariantMap &)> changed) \
+        { \
+            properties_changed_ = std::move(changed); \
+            connection().connect(service(), \
+                                 path(), \
+                                 ::hardbus::internal::PropertiesInterface(), \
+                                 QStringLiteral("PropertiesChanged"), \
+                                 this, \
+                                 SLOT(hardbus_properties_changed(QString, QVariantMap, QStringList))); \
+        } \
+        void hardbus_properties_changed(const QString &interface, const QVariantMap &changed, const QStringList &) \
+        { \
+            if (interface == QLatin1String(Tag::dbus_service_interface) && properties_changed_) { \
+                properties_changed_(changed); \
+            } \
+        } \
+        W_SLOT(hardbus_properties_changed) \
+        /* Relays \a signal of the service to the access object. Connecting */ \
+        /* to a signal adds its match rule to the bus, disconnecting removes it */ \
+        void SetSubscribed(const QMetaMethod &signal, bool subscribed) \
+        { \
+            Q_UNUSED(signal); \
+            Q_UNUSED(subscribed); \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IMPORT_SUBSCRIBE_, HARDBUS_INTERNAL_IGNORE_) \
+        } \
     public: \
-        API(HARDBUS_INTERNAL_IMPORT_FUNC_, HARDBUS_INTERNAL_IMPORT_SIGNAL_) \
+        HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IMPORT_FUNC_, HARDBUS_INTERNAL_IMPORT_SIGNAL_, HARDBUS_INTERNAL_IGNORE_) \
     };
 
 #define HARDBUS_INTERNAL_IMPORT_FUNC_(OUT, FUNC, ARGS, ...) \
-    QString FUNC(HARDBUS_INTERNAL_TO_STRING_ARGS_ ARGS) \
+    HARDBUS_INTERNAL_METHOD_PROXY_TYPE_(HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), OUT) \
+    FUNC(HARDBUS_INTERNAL_TO_METHOD_PROXY_ARGS_(HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), ARGS)) \
     { \
         auto helper = [&](auto &&... args) { \
-            return ::hardbus::internal::CallFuncOverDBus(this, #FUNC, HARDBUS_FWD(args)...); \
+            return ::hardbus::internal::CallFuncOverDBus< \
+                HARDBUS_INTERNAL_METHOD_PROXY_TYPE_(HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), OUT)>( \
+                HARDBUS_INTERNAL_IS_ONEWAY_(__VA_ARGS__){}, this, call_of_##FUNC, HARDBUS_FWD(args)...); \
         }; \
         return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
-    }
+    } \
+    QDBusPendingCall FUNC##Async( \
+        HARDBUS_INTERNAL_TO_METHOD_PROXY_ARGS_(HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__), ARGS)) \
+    { \
+        auto helper = [&](auto &&... args) { \
+            return ::hardbus::internal::CallFuncOverDBusAsync(HARDBUS_INTERNAL_IS_ONEWAY_(__VA_ARGS__){}, \
+                                                              this, \
+                                                              call_of_##FUNC, \
+                                                              HARDBUS_FWD(args)...); \
+        }; \
+        return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+    } \
+\
+        private : const QDBusMessage call_of_##FUNC{ \
+            ::hardbus::internal::MethodCallTemplate(this, QStringLiteral(#FUNC))}; \
+\
+    public:
 
-#define HARDBUS_INTERNAL_IMPORT_SIGNAL_(OUT, FUNC, ARGS) \
-    OUT FUNC(HARDBUS_INTERNAL_TO_STRING_ARGS_ ARGS) HARDBUS_INTERNAL_W_SIGNAL(FUNC, ARGS) \
+#define HARDBUS_INTERNAL_IMPORT_SIGNAL_(OUT, FUNC, ARGS, ...) \
+    HARDBUS_INTERNAL_SIGNAL_DECL_(OUT, FUNC, ARGS, __VA_ARGS__) \
 \
-        private : bool connectror_for_##FUNC \
-                  = ::hardbus::internal::MakeProxyConnector1(this, \
-                                                             &Self::FUNC, \
-                                                             interface_, \
-                                                             &Interface::FUNC);
+        private : QMetaObject::Connection subscription_to_##FUNC; \
+\
+    public:
+
+#define HARDBUS_INTERNAL_IMPORT_SUBSCRIBE_(OUT, FUNC, ARGS, ...) \
+    if (signal == QMetaMethod::fromSignal(&Interface::FUNC)) { \
+        ::hardbus::internal::UpdateSubscription(subscription_to_##FUNC, subscribed, [this] { \
+            return ::hardbus::internal::MakeImportConnector(HARDBUS_INTERNAL_IS_BATCHED_(__VA_ARGS__){}, \
+                                                            ::hardbus::internal::MetricsFor<Tag>().Import(#FUNC), \
+                                                            this, \
+                                                            &Self::FUNC, \
+                                                            interface_, \
+                                                            &Interface::FUNC); \
+        }); \
+    }
 
 //////
 #define HARDBUS_INTERNAL_DEFINE_ACCESS_ADAPTOR_(TAG, API) \
@@ -475,39 +4844,463 @@ R ReturnValueOrVoid(const F &f, std::false_type)
         W_OBJECT(AccessFor##TAG) \
 \
         using Tag = TraitsFor##TAG; \
+        using Interface = Tag::interface; \
         using DbusInterface = ImportAdaptorFor##TAG; \
         using Self = AccessFor##TAG; \
 \
     public: \
-        DbusInterface *dbus_interface_{nullptr}; \
-        explicit AccessFor##TAG(QObject *parent = nullptr) { setParent(parent); } \
-        API(HARDBUS_INTERNAL_ACCESS_FUNC_, HARDBUS_INTERNAL_ACCESS_SIGNAL_) \
+        std::shared_ptr<DbusInterface> dbus_interface_; \
+        QPointer<Interface> local_interface_; \
+        explicit AccessFor##TAG(QObject *parent = nullptr) \
+        { \
+            setParent(parent); \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_ACCESS_INVALIDATION_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_) \
+        } \
+        /* Closes the peer connection of this access object, if it has one */ \
+        ~AccessFor##TAG() override { Disconnect(); } \
+        ::hardbus::CacheStats CacheStats() const { return cache_.Stats(); } \
+        /* Records the following asynchronous calls of this thread instead of sending them */ \
+        void BeginBatch() \
+        { \
+            QMutexLocker lock{&state_mutex_}; \
+            auto &batch = batches_[QThread::currentThread()]; \
+            if (!batch) { \
+                batch = std::make_shared<::hardbus::internal::BatchState>(); \
+            } \
+        } \
+        /* Sends the calls recorded by this thread as one message */ \
+        void SendBatch() \
+        { \
+            QMutexLocker lock{&state_mutex_}; \
+            const auto it = batches_.find(QThread::currentThread()); \
+            if (it == batches_.end()) { \
+                return; \
+            } \
+            auto batch = std::move(it->second); \
+            batches_.erase(it); \
+            lock.unlock(); \
+            Send(std::move(batch)); \
+        } \
+        /* While the service restarts, blocking calls wait up to \a timeout_ms */ \
+        /* for it to come back and asynchronous calls are queued until then. */ \
+        /* By default they fail right away */ \
+        void QueueCallsWhileDisconnected(int timeout_ms) { queue_timeout_ms_ = timeout_ms; } \
+        /* Talks to the peer-to-peer server of the service, if it has one, */ \
+        /* instead of going through the bus daemon. Set before connecting */ \
+        void SetPeerToPeer(bool enabled) { peer_to_peer_ = enabled; } \
+        /* Connects to the service over the bus, or directly to its peer-to-peer */ \
+        /* server, and follows its restarts */ \
+        void ConnectRemote() \
+        { \
+            auto bus = Tag::connection_type(); \
+            auto connection = peer_to_peer_ && object_path_ == QLatin1String(Tag::dbus_service_path) \
+                                  ? ::hardbus::internal::ConnectPeer(Tag::dbus_service_name, \
+                                                                     Tag::dbus_service_path, \
+                                                                     Tag::dbus_service_interface, \
+                                                                     bus) \
+                                  : bus; \
+            auto is_peer = connection.name() != bus.name(); \
+            std::atomic_store(&dbus_interface_, \
+                              ::hardbus::internal::ShareAdaptor(new DbusInterface{ \
+                                  this, is_peer ? QString{} : QString{Tag::dbus_service_name}, connection, object_path_})); \
+            { \
+                QMutexLocker lock{&state_mutex_}; \
+                reconnected_.wakeAll(); \
+            } \
+            SyncSubscriptions(); \
+            FetchProperties(); \
+            if (!follows_owner_) { \
+                follows_owner_ = true; \
+                service_watcher_ = new QDBusServiceWatcher{Tag::dbus_service_name, \
+                                                           bus, \
+                                                           QDBusServiceWatcher::WatchForOwnerChange, \
+                                                           this}; \
+                /* already connected when a blocking call of this thread waited for it */ \
+                QObject::connect(service_watcher_, &QDBusServiceWatcher::serviceRegistered, this, [this] { \
+                    if (!RemoteInterface()) { \
+                        Reconnect(); \
+                    } \
+                }); \
+                QObject::connect(service_watcher_, &QDBusServiceWatcher::serviceUnregistered, this, [this] { \
+                    Disconnect(); \
+                }); \
+                /* the name was handed over without being released in between */ \
+                QObject::connect(service_watcher_, \
+                                 &QDBusServiceWatcher::serviceOwnerChanged, \
+                                 this, \
+                                 [this](const QString &, const QString &old_owner, const QString &owner) { \
+                                     if (!old_owner.isEmpty() && !owner.isEmpty()) { \
+                                         Reconnect(); \
+                                     } \
+                                 }); \
+            } \
+        } \
+        /* Subscribes to the signals of the service that have receivers */ \
+        void SyncSubscriptions() \
+        { \
+            if (thread() != QThread::currentThread()) { \
+                QMetaObject::invokeMethod(this, [this] { SyncSubscriptions(); }, Qt::QueuedConnection); \
+                return; \
+            } \
+            if (const auto remote = RemoteInterface()) { \
+                HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_ACCESS_SUBSCRIBE_, HARDBUS_INTERNAL_IGNORE_) \
+            } \
+        } \
+        void ClearCache() { cache_.Clear(); } \
+        /* Import adaptor calls go through, kept alive while a call uses it */ \
+        std::shared_ptr<DbusInterface> RemoteInterface() const { return std::atomic_load(&dbus_interface_); } \
+        /* Talks to \a path, an object of a service tree, once connected */ \
+        void SetObjectPath(const QString &path) { object_path_ = path; } \
+        /* Serves calls with an implementation living in this process */ \
+        void ConnectLocal(Interface *local) \
+        { \
+            local_interface_ = local; \
+            HARDBUS_INTERNAL_API_(API, \
+                                  HARDBUS_INTERNAL_IGNORE_, \
+                                  HARDBUS_INTERNAL_ACCESS_LOCAL_SIGNAL_, \
+                                  HARDBUS_INTERNAL_ACCESS_LOCAL_PROPERTY_) \
+        } \
+        HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_ACCESS_FUNC_, HARDBUS_INTERNAL_ACCESS_SIGNAL_, HARDBUS_INTERNAL_ACCESS_PROPERTY_) \
+\
+    protected: \
+        void connectNotify(const QMetaMethod &) override { SyncSubscriptions(); } \
+        void disconnectNotify(const QMetaMethod &) override { SyncSubscriptions(); } \
+\
+    private: \
+        /* The old import adaptor talks to the previous owner, so build a new one */ \
+        enum { property_count = 0 HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_COUNT_PROPERTY_) }; \
+        /* Subscribes to property changes, then gets all the values once */ \
+        void FetchProperties() \
+        { \
+            if (property_count == 0) { \
+                return; \
+            } \
+            const auto remote = RemoteInterface(); \
+            remote->WatchProperties([this](const QVariantMap &values) { UpdateProperties(values, true); }); \
+            UpdateProperties(::hardbus::internal::GetAllProperties(*remote), false); \
+        } \
+        void UpdateProperties(const QVariantMap &values, bool notify) \
+        { \
+            Q_UNUSED(values); \
+            Q_UNUSED(notify); \
+            HARDBUS_INTERNAL_API_(API, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_IGNORE_, HARDBUS_INTERNAL_ACCESS_UPDATE_PROPERTY_) \
+        } \
+        /* Drops the import adaptor of the owner that went away */ \
+        void Disconnect() \
+        { \
+            const auto previous = RemoteInterface(); \
+            std::atomic_store(&dbus_interface_, std::shared_ptr<DbusInterface>{}); \
+            /* the peer server went away with the previous owner */ \
+            if (previous && previous->connection().name() != Tag::connection_type().name()) { \
+                QDBusConnection::disconnectFromPeer(previous->connection().name()); \
+            } \
+            cache_.Clear(); \
+        } \
+        /* Talks to the new owner, then sends the calls queued meanwhile */ \
+        void Reconnect() \
+        { \
+            Disconnect(); \
+            ConnectRemote(); \
+            QMutexLocker lock{&state_mutex_}; \
+            auto queued = std::move(queued_); \
+            queued_ = nullptr; \
+            lock.unlock(); \
+            Send(std::move(queued)); \
+        } \
+        void Send(std::shared_ptr<::hardbus::internal::BatchState> batch) \
+        { \
+            if (!batch) { \
+                return; \
+            } \
+            QMutexLocker lock{&batch->mutex}; \
+            if (batch->functions.isEmpty()) { \
+                return; \
+            } \
+            const auto functions = batch->functions; \
+            const auto arguments = batch->arguments; \
+            lock.unlock(); \
+            const auto remote = RemoteInterface(); \
+            batch->SetCall(remote ? remote->asyncCall(QStringLiteral("hardbus_batch"), functions, arguments) \
+                                  : QDBusPendingCall::fromError(QDBusError{QDBusError::Failed, \
+                                                                           QStringLiteral("service not registered")})); \
+        } \
+        bool IsReconnecting() const \
+        { \
+            return !RemoteInterface() && follows_owner_ && queue_timeout_ms_ > 0; \
+        } \
+        /* Batch recording asynchronous calls, if any */ \
+        std::shared_ptr<::hardbus::internal::BatchState> RecordingBatch() const \
+        { \
+            QMutexLocker lock{&state_mutex_}; \
+            const auto it = batches_.find(QThread::currentThread()); \
+            if (it != batches_.end()) { \
+                return it->second; \
+            } \
+            if (IsReconnecting()) { \
+                if (!queued_) { \
+                    queued_ = std::make_shared<::hardbus::internal::BatchState>(); \
+                } \
+                return queued_; \
+            } \
+            return nullptr; \
+        } \
+        void WaitForReconnection() const \
+        { \
+            if (!IsReconnecting()) { \
+                return; \
+            } \
+            const int timeout_ms = queue_timeout_ms_; \
+            QElapsedTimer elapsed; \
+            elapsed.start(); \
+            if (thread() == QThread::currentThread()) { \
+                /* service_watcher_ cannot report while its thread waits, so wait with a watcher of another thread */ \
+                if (::hardbus::WaitForServiceRegistration(Tag::dbus_service_name, Tag::connection_type(), timeout_ms) \
+                    && IsReconnecting()) { \
+                    const_cast<Self *>(this)->Reconnect(); \
+                } \
+                return; \
+            } \
+            QMutexLocker lock{&state_mutex_}; \
+            while (IsReconnecting() && !elapsed.hasExpired(timeout_ms)) { \
+                reconnected_.wait(&state_mutex_, static_cast<unsigned long>(qMax<qint64>(1, timeout_ms - elapsed.elapsed()))); \
+            } \
+        } \
+\
+        mutable ::hardbus::internal::CallCache cache_; \
+        /* Guards the batches, which calls from any thread may record into */ \
+        mutable QMutex state_mutex_; \
+        /* Guards the copies of the properties, read from any thread */ \
+        mutable QMutex properties_mutex_; \
+        /* Batch each thread records into, between its BeginBatch and SendBatch */ \
+        std::map<QThread *, std::shared_ptr<::hardbus::internal::BatchState>> batches_; \
+        mutable std::shared_ptr<::hardbus::internal::BatchState> queued_; \
+        /* Woken when a new import adaptor is connected */ \
+        mutable QWaitCondition reconnected_; \
+        QDBusServiceWatcher *service_watcher_{nullptr}; \
+        /* Set by the thread of the access object once it follows the owner of the service */ \
+        std::atomic<bool> follows_owner_{false}; \
+        std::atomic<int> queue_timeout_ms_{0}; \
+        bool peer_to_peer_{false}; \
+        QString object_path_{Tag::dbus_service_path}; \
     };
 
+#define HARDBUS_INTERNAL_ACCESS_SUBSCRIBE_(OUT, FUNC, ARGS, ...) \
+    { \
+        const auto signal = QMetaMethod::fromSignal(&Interface::FUNC); \
+        remote->SetSubscribed(signal, isSignalConnected(signal)); \
+    }
+
 #define HARDBUS_INTERNAL_ACCESS_SIGNAL_(...) /*no impl*/
 
+#define HARDBUS_INTERNAL_ACCESS_LOCAL_SIGNAL_(OUT, FUNC, ARGS, ...) \
+    QObject::connect(local, &Interface::FUNC, this, &Interface::FUNC);
+
+#define HARDBUS_INTERNAL_ACCESS_LOCAL_PROPERTY_(TYPE, NAME) \
+    QObject::connect(local, &Interface::NAME##Changed, this, &Interface::NAME##Changed);
+
+/* Reads of a property return the copy, kept current by PropertiesChanged */
+#define HARDBUS_INTERNAL_ACCESS_PROPERTY_(TYPE, NAME) \
+    W_MACRO_REMOVEPAREN(TYPE) NAME() const override \
+    { \
+        if (local_interface_) { \
+            return ::hardbus::internal::LocalCall<W_MACRO_REMOVEPAREN(TYPE)>(local_interface_, \
+                                                                           [&] { return local_interface_->NAME(); }); \
+        } \
+        QMutexLocker lock{&properties_mutex_}; \
+        return property_##NAME##_; \
+    } \
+\
+    private: \
+    W_MACRO_REMOVEPAREN(TYPE) property_##NAME##_{}; \
+\
+    public:
+
+#define HARDBUS_INTERNAL_ACCESS_UPDATE_PROPERTY_(TYPE, NAME) \
+    if (values.contains(QStringLiteral(#NAME))) { \
+        using T = W_MACRO_REMOVEPAREN(TYPE); \
+        T value = ::hardbus::internal::FromProxy<T>( \
+            ::hardbus::internal::ProxyFromVariant<::hardbus::internal::ProxyType<T>>(values.value(QStringLiteral(#NAME)))); \
+        { \
+            QMutexLocker lock{&properties_mutex_}; \
+            property_##NAME##_ = value; \
+        } \
+        if (notify) { \
+            ::hardbus::internal::EmitNotify(this, &Interface::NAME##Changed, value); \
+        } \
+    }
+
+#define HARDBUS_INTERNAL_ACCESS_INVALIDATION_(OUT, FUNC, ARGS, ...) \
+    BOOST_PP_SEQ_FOR_EACH(HARDBUS_INTERNAL_INVALIDATED_BY_CB_, FUNC, HARDBUS_INTERNAL_SPECS_SEQ_(__VA_ARGS__))
+
+#define HARDBUS_INTERNAL_INVALIDATED_BY_CB_(r, FUNC, elem) \
+    BOOST_PP_IIF(HARDBUS_INTERNAL_PROBE_(HARDBUS_INTERNAL_SPEC_PASTE_(HARDBUS_INTERNAL_SPEC_IS_INVALIDATED_BY, elem)), \
+                 HARDBUS_INTERNAL_ACCESS_INVALIDATE_, \
+                 HARDBUS_INTERNAL_IGNORE_) \
+    (FUNC, HARDBUS_INTERNAL_SPEC_PASTE_(HARDBUS_INTERNAL_SPEC_VALUE_INVALIDATED_BY, elem))
+
+/* BOOST_PP_REPEAT, since BOOST_PP_SEQ_FOR_EACH does not nest */
+#define HARDBUS_INTERNAL_ACCESS_INVALIDATE_(FUNC, ...) \
+    BOOST_PP_REPEAT(BOOST_PP_VARIADIC_SIZE(__VA_ARGS__), HARDBUS_INTERNAL_ACCESS_INVALIDATE_CB_, (FUNC, (__VA_ARGS__)))
+
+#define HARDBUS_INTERNAL_ACCESS_INVALIDATE_CB_(z, n, DATA) \
+    QObject::connect(this, \
+                     &Interface::BOOST_PP_TUPLE_ELEM(n, BOOST_PP_TUPLE_ELEM(1, DATA)), \
+                     this, \
+                     [this] { cache_.Invalidate(BOOST_PP_STRINGIZE(BOOST_PP_TUPLE_ELEM(0, DATA))); });
+
 #define HARDBUS_INTERNAL_ACCESS_FUNC_(OUT, FUNC, ARGS, ...) \
-    W_MACRO_REMOVEPAREN(OUT) FUNC(HARDBUS_INTERNAL_TO_ARGS_ ARGS) W_MACRO_REMOVEPAREN(__VA_ARGS__) override \
+    W_MACRO_REMOVEPAREN(OUT) FUNC(HARDBUS_INTERNAL_TO_ARGS_ ARGS) HARDBUS_INTERNAL_QUALIFIERS_(__VA_ARGS__) override \
     { \
         using R = decltype(::hardbus::internal::DeduceReturnType(&Self::FUNC)); \
+        if (local_interface_) { \
+            HARDBUS_INTERNAL_ACCESS_LOCAL_CALL_(FUNC, ARGS, __VA_ARGS__) \
+        } \
+        WaitForReconnection(); \
+        using TO = ::hardbus::internal::MethodToProxyConverter<HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)>; \
+        const auto remote = RemoteInterface(); \
+        ::hardbus::internal::FdTransfer::Scope fds{remote.get()}; \
+        auto helper = [&](auto &&... args) { \
+            return ::hardbus::internal::ProxyCallHelper2<TO>(&DbusInterface::FUNC, \
+                                                             remote.get(), \
+                                                             HARDBUS_FWD(args)...); \
+        }; \
+        return ::hardbus::internal::CachedCall<R>( \
+            HARDBUS_INTERNAL_CACHE_TTL_(__VA_ARGS__){}, \
+            cache_, \
+            #FUNC, \
+            [&] { \
+                static auto &metrics = ::hardbus::internal::MetricsFor<Tag>().Import(#FUNC); \
+                return ::hardbus::internal::Measure(metrics, &metrics.round_trip, [&] { \
+                    return ::hardbus::internal::ReturnValueOrVoid<R>( \
+                        [&] { return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); }, std::is_same<R, void>{}); \
+                }); \
+            } HARDBUS_INTERNAL_COMMA_IF_ARGS_(ARGS) HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+    } \
+    ::hardbus::PendingReply<W_MACRO_REMOVEPAREN(OUT)> FUNC##Async(HARDBUS_INTERNAL_TO_ARGS_ ARGS) const \
+    { \
+        using R = W_MACRO_REMOVEPAREN(OUT); \
+        if (local_interface_) { \
+            const auto local = local_interface_; \
+            return ::hardbus::PendingReply<R>{::hardbus::internal::LocalInvokeAsync<R>( \
+                HARDBUS_INTERNAL_IS_ONEWAY_(__VA_ARGS__){}, local, [=] { \
+                    if (!local) { \
+                        throw ::hardbus::Exception{"service not registered"}; \
+                    } \
+                    return local->FUNC(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+                })}; \
+        } \
+        using TO = ::hardbus::internal::MethodToProxyConverter<HARDBUS_INTERNAL_IS_COMPRESSED_(__VA_ARGS__)>; \
+        if (auto batch = RecordingBatch()) { \
+            ::hardbus::internal::FdTransfer::Scope fds{RemoteInterface().get()}; \
+            auto record = [&](const auto &... args) { \
+                return batch->Add(#FUNC, \
+                                  {QVariant::fromValue(TO{}(args))...}); \
+            }; \
+            return ::hardbus::PendingReply<R>{batch, record(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS)}; \
+        } \
+        const auto remote = RemoteInterface(); \
+        ::hardbus::internal::FdTransfer::Scope fds{remote.get()}; \
         auto helper = [&](auto &&... args) { \
-            return ::hardbus::internal::ProxyCallHelper2(&DbusInterface::FUNC, \
-                                                         dbus_interface_, \
-                                                         HARDBUS_FWD(args)...); \
+            return ::hardbus::internal::ProxyAsyncCallHelper<TO>(&DbusInterface::FUNC##Async, \
+                                                                 remote.get(), \
+                                                                 HARDBUS_FWD(args)...); \
         }; \
-        return ::hardbus::internal::ReturnValueOrVoid<R>([&] { return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); }, \
-                                                         std::is_same<R, void>{}); \
+        static auto &metrics = ::hardbus::internal::MetricsFor<Tag>().Import(#FUNC); \
+        const auto call = ::hardbus::internal::Measure( \
+            metrics, nullptr, [&] { return helper(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); }); \
+        ::hardbus::internal::CountErrorWhenFinished(call, metrics, remote.get()); \
+        return ::hardbus::PendingReply<R>{call}; \
     }
 
+/* Blocking calls wait for the implementation, one-way calls only queue it as over the bus */
+#define HARDBUS_INTERNAL_ACCESS_LOCAL_CALL_(FUNC, ARGS, ...) \
+    BOOST_PP_IIF(HARDBUS_INTERNAL_HAS_SPEC_(ONEWAY, __VA_ARGS__), \
+                 HARDBUS_INTERNAL_ACCESS_LOCAL_SEND_, \
+                 HARDBUS_INTERNAL_ACCESS_LOCAL_INVOKE_) \
+    (FUNC, ARGS)
+
+#define HARDBUS_INTERNAL_ACCESS_LOCAL_INVOKE_(FUNC, ARGS) \
+    return ::hardbus::internal::LocalCall<R>(local_interface_, [&] { \
+        return local_interface_->FUNC(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+    });
+
+#define HARDBUS_INTERNAL_ACCESS_LOCAL_SEND_(FUNC, ARGS) \
+    FUNC##Async(HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS); \
+    return;
+
 
 //////
 
+#define HARDBUS_INTERNAL_REGISTER_PROXY_TYPES_(OUT, FUNC, ...) \
+    ::hardbus::internal::RegisterProxyTypesOf(&Self::FUNC);
+
+/* Batched signals carry a variant list, so register types of the interface signal */
+#define HARDBUS_INTERNAL_REGISTER_SIGNAL_PROXY_TYPES_(OUT, FUNC, ...) \
+    ::hardbus::internal::RegisterProxyTypesOf(&Interface::FUNC);
+
+#define HARDBUS_INTERNAL_REGISTER_PROPERTY_PROXY_TYPE_(TYPE, NAME) \
+    ::hardbus::internal::RegisterProxyType<::hardbus::internal::ProxyType<W_MACRO_REMOVEPAREN(TYPE)>>();
+
+#define HARDBUS_INTERNAL_COUNT_PROPERTY_(...) +1
+
+#define HARDBUS_INTERNAL_IS_ONEWAY_(...) \
+    std::integral_constant<bool, HARDBUS_INTERNAL_HAS_SPEC_(ONEWAY, __VA_ARGS__)>
+
+#define HARDBUS_INTERNAL_IS_COMPRESSED_(...) HARDBUS_INTERNAL_HAS_SPEC_(COMPRESSED, __VA_ARGS__)
+
+#define HARDBUS_INTERNAL_IS_BATCHED_(...) \
+    std::integral_constant<bool, HARDBUS_INTERNAL_HAS_SPEC_(BATCHED, __VA_ARGS__)>
+
+/* Batched signals send all collected emissions as one variant list */
+#define HARDBUS_INTERNAL_SIGNAL_DECL_(OUT, FUNC, ARGS, ...) \
+    BOOST_PP_IIF(HARDBUS_INTERNAL_HAS_SPEC_(BATCHED, __VA_ARGS__), \
+                 HARDBUS_INTERNAL_BATCHED_SIGNAL_DECL_, \
+                 HARDBUS_INTERNAL_PROXY_SIGNAL_DECL_) \
+    (OUT, FUNC, ARGS)
+
+#define HARDBUS_INTERNAL_PROXY_SIGNAL_DECL_(OUT, FUNC, ARGS) \
+    OUT FUNC(HARDBUS_INTERNAL_TO_PROXY_ARGS_ ARGS) HARDBUS_INTERNAL_W_SIGNAL(FUNC, ARGS)
+
+#define HARDBUS_INTERNAL_BATCHED_SIGNAL_DECL_(OUT, FUNC, ARGS) void FUNC(QVariantList batch) W_SIGNAL(FUNC, batch)
+
+#define HARDBUS_INTERNAL_SIGNAL_EMISSION_(...) \
+    BOOST_PP_IIF(HARDBUS_INTERNAL_HAS_SPEC_(BATCHED, __VA_ARGS__), \
+                 HARDBUS_INTERNAL_BATCHED_EMISSION_, \
+                 HARDBUS_INTERNAL_UNBATCHED_EMISSION_) \
+    (__VA_ARGS__)
+
+#define HARDBUS_INTERNAL_BATCHED_EMISSION_(...) \
+    ::hardbus::internal::BatchedEmission<W_MACRO_REMOVEPAREN(HARDBUS_INTERNAL_SPEC_(BATCHED, __VA_ARGS__))>
+
+#define HARDBUS_INTERNAL_UNBATCHED_EMISSION_(...) \
+    BOOST_PP_IIF(HARDBUS_INTERNAL_HAS_SPEC_(LATEST, __VA_ARGS__), \
+                 HARDBUS_INTERNAL_LATEST_EMISSION_, \
+                 HARDBUS_INTERNAL_DIRECT_EMISSION_) \
+    (__VA_ARGS__)
+
+#define HARDBUS_INTERNAL_LATEST_EMISSION_(...) \
+    ::hardbus::internal::LatestEmission<HARDBUS_INTERNAL_SPEC_(LATEST, __VA_ARGS__)>
+
+#define HARDBUS_INTERNAL_DIRECT_EMISSION_(...) ::hardbus::internal::DirectEmission
+
+#define HARDBUS_INTERNAL_CACHE_TTL_(...) \
+    std::integral_constant<int, \
+                           BOOST_PP_IIF(HARDBUS_INTERNAL_HAS_SPEC_(CACHED, __VA_ARGS__), \
+                                        HARDBUS_INTERNAL_SPEC_(CACHED, __VA_ARGS__), \
+                                        0)>
+
+#define HARDBUS_INTERNAL_IGNORE_(...) /*nothing*/
+
 #define HARDBUS_FWD(...) ::std::forward<decltype(__VA_ARGS__)>(__VA_ARGS__)
 
 #define HARDBUS_INTERNAL_ARG_STRING_(...) QString
+#define HARDBUS_INTERNAL_PROXY_TYPE_(T) ::hardbus::internal::ProxyType<W_MACRO_REMOVEPAREN(T)>
+#define HARDBUS_INTERNAL_METHOD_PROXY_TYPE_(C, T) ::hardbus::internal::MethodProxyType<W_MACRO_REMOVEPAREN(T), C>
 #define HARDBUS_INTERNAL_ARG_SAME_(...) __VA_ARGS__
 #define HARDBUS_INTERNAL_ARG_VOID_(...) void
 
+#define HARDBUS_INTERNAL_COMMA_IF_ARGS_(ARGS) BOOST_PP_COMMA_IF(BOOST_PP_NOT(TUPLE_IS_EMPTY ARGS))
+
 #define HARDBUS_INTERNAL_W_SIGNAL(FUNC, ARGS)  W_SIGNAL(FUNC BOOST_PP_COMMA_IF( BOOST_PP_NOT(TUPLE_IS_EMPTY ARGS) ) HARDBUS_INTERNAL_TO_ARGS_NAMES ARGS)
 
 ///////////////////////////////////////////////////////////////////////////////////
@@ -548,14 +5341,96 @@ R ReturnValueOrVoid(const F &f, std::false_type)
     (BOOST_PP_TUPLE_TO_SEQ((__VA_ARGS__)))
 
 /////////////////////////////////
-#define HARDBUS_INTERNAL_GEN_NONEMPTY_STRING_ARGS_CB_(unused, data, idx, elem) \
-    BOOST_PP_COMMA_IF(idx) QString arg##idx
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_PROXY_ARGS_CB_(unused, data, idx, elem) \
+    BOOST_PP_COMMA_IF(idx) HARDBUS_INTERNAL_PROXY_TYPE_(elem) arg##idx
 
-#define HARDBUS_INTERNAL_GEN_NONEMPTY_STRING_ARGS_(seq) \
-    BOOST_PP_SEQ_FOR_EACH_I(HARDBUS_INTERNAL_GEN_NONEMPTY_STRING_ARGS_CB_, ~, seq)
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_PROXY_ARGS_(seq) \
+    BOOST_PP_SEQ_FOR_EACH_I(HARDBUS_INTERNAL_GEN_NONEMPTY_PROXY_ARGS_CB_, ~, seq)
 
-#define HARDBUS_INTERNAL_TO_STRING_ARGS_(...) \
-    BOOST_PP_IF(TUPLE_IS_EMPTY(__VA_ARGS__), HARDBUS_INTERNAL_GEN_EMPTY_ARGS_, HARDBUS_INTERNAL_GEN_NONEMPTY_STRING_ARGS_) \
+#define HARDBUS_INTERNAL_TO_PROXY_ARGS_(...) \
+    BOOST_PP_IF(TUPLE_IS_EMPTY(__VA_ARGS__), HARDBUS_INTERNAL_GEN_EMPTY_ARGS_, HARDBUS_INTERNAL_GEN_NONEMPTY_PROXY_ARGS_) \
     (BOOST_PP_TUPLE_TO_SEQ((__VA_ARGS__)))
 
+/* arguments of functions, compressed if C is 1 */
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_ARGS_CB_(unused, C, idx, elem) \
+    BOOST_PP_COMMA_IF(idx) HARDBUS_INTERNAL_METHOD_PROXY_TYPE_(C, elem) arg##idx
+
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_ARGS_(C, seq) \
+    BOOST_PP_SEQ_FOR_EACH_I(HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_ARGS_CB_, C, seq)
+
+#define HARDBUS_INTERNAL_TO_METHOD_PROXY_ARGS_(C, ARGS) \
+    BOOST_PP_IF(TUPLE_IS_EMPTY ARGS, HARDBUS_INTERNAL_GEN_EMPTY_ARGS_, HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_ARGS_) \
+    (C, BOOST_PP_TUPLE_TO_SEQ(ARGS))
+
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_TYPES_CB_(unused, C, idx, elem) \
+    BOOST_PP_COMMA_IF(idx) HARDBUS_INTERNAL_METHOD_PROXY_TYPE_(C, elem)
+
+#define HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_TYPES_(C, seq) \
+    BOOST_PP_SEQ_FOR_EACH_I(HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_TYPES_CB_, C, seq)
+
+#define HARDBUS_INTERNAL_TO_METHOD_PROXY_TYPES_(C, ARGS) \
+    BOOST_PP_IF(TUPLE_IS_EMPTY ARGS, HARDBUS_INTERNAL_GEN_EMPTY_ARGS_, HARDBUS_INTERNAL_GEN_NONEMPTY_METHOD_PROXY_TYPES_) \
+    (C, BOOST_PP_TUPLE_TO_SEQ(ARGS))
+
+/////////////////////////////////
+// Method specifiers, e.g. FUNC(void, Baz, (), (const, oneway))
+#define HARDBUS_INTERNAL_PROBE_N_(x, n, ...) n
+#define HARDBUS_INTERNAL_PROBE_(...) HARDBUS_INTERNAL_PROBE_N_(__VA_ARGS__, 0, ~)
+
+// prefixes are not macros themselves, so only the specifier gets expanded before pasting
+#define HARDBUS_INTERNAL_SPEC_PASTE_(PREFIX, elem) HARDBUS_INTERNAL_SPEC_PASTE_I_(PREFIX, elem)
+#define HARDBUS_INTERNAL_SPEC_PASTE_I_(PREFIX, elem) PREFIX##_##elem
+
+#define HARDBUS_INTERNAL_SPECS_SEQ_(...) BOOST_PP_TUPLE_TO_SEQ((none, W_MACRO_REMOVEPAREN(__VA_ARGS__)))
+
+#define HARDBUS_INTERNAL_SPEC_CB_(r, KIND, elem) \
+    BOOST_PP_EXPR_IIF(HARDBUS_INTERNAL_PROBE_(HARDBUS_INTERNAL_SPEC_PASTE_(HARDBUS_INTERNAL_SPEC_IS_##KIND, elem)), \
+                      HARDBUS_INTERNAL_SPEC_PASTE_(HARDBUS_INTERNAL_SPEC_VALUE_##KIND, elem))
+
+//! Value of the \a KIND specifier, nothing if absent
+#define HARDBUS_INTERNAL_SPEC_(KIND, ...) \
+    BOOST_PP_SEQ_FOR_EACH(HARDBUS_INTERNAL_SPEC_CB_, KIND, HARDBUS_INTERNAL_SPECS_SEQ_(__VA_ARGS__))
+
+//! 1 if the \a KIND specifier is present, 0 otherwise
+#define HARDBUS_INTERNAL_HAS_SPEC_(KIND, ...) \
+    BOOST_PP_COMPL(BOOST_PP_IS_EMPTY(HARDBUS_INTERNAL_SPEC_(KIND, __VA_ARGS__)))
+
+#define HARDBUS_INTERNAL_QUALIFIER_CB_(r, data, elem) HARDBUS_INTERNAL_SPEC_PASTE_(HARDBUS_INTERNAL_SPEC_QUALIFIER, elem)
+
+//! C++ qualifiers of the access function
+#define HARDBUS_INTERNAL_QUALIFIERS_(...) \
+    BOOST_PP_SEQ_FOR_EACH(HARDBUS_INTERNAL_QUALIFIER_CB_, ~, HARDBUS_INTERNAL_SPECS_SEQ_(__VA_ARGS__))
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_none
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_const const
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_noexcept noexcept
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_oneway
+#define HARDBUS_INTERNAL_SPEC_IS_ONEWAY_oneway ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_ONEWAY_oneway 1
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_concurrent
+#define HARDBUS_INTERNAL_SPEC_IS_CONCURRENT_concurrent ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_CONCURRENT_concurrent 1
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_cached(...)
+#define HARDBUS_INTERNAL_SPEC_IS_CACHED_cached(...) ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_CACHED_cached(...) __VA_ARGS__
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_invalidated_by(...)
+#define HARDBUS_INTERNAL_SPEC_IS_INVALIDATED_BY_invalidated_by(...) ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_INVALIDATED_BY_invalidated_by(...) __VA_ARGS__
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_latest(...)
+#define HARDBUS_INTERNAL_SPEC_IS_LATEST_latest(...) ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_LATEST_latest(...) __VA_ARGS__
+
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_compressed
+#define HARDBUS_INTERNAL_SPEC_IS_COMPRESSED_compressed ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_COMPRESSED_compressed 1
 
+/* parenthesized, values are separated by a comma */
+#define HARDBUS_INTERNAL_SPEC_QUALIFIER_batched(...)
+#define HARDBUS_INTERNAL_SPEC_IS_BATCHED_batched(...) ~, 1,
+#define HARDBUS_INTERNAL_SPEC_VALUE_BATCHED_batched(...) (__VA_ARGS__)
@@ -0,0 +1,116 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Batches of asynchronous calls: replies stay unfinished until the batch is
+// sent, a failing call only fails its own reply and Then() waits for the batch
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <vector>
+
+class BatchTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+        access_ = qobject_cast<TestDefinition::Access *>(remote_);
+        QVERIFY(access_);
+    }
+
+    void RepliesWaitForTheBatch()
+    {
+        access_->BeginBatch();
+        auto echo = access_->EchoAsync(1);
+        auto sum = access_->SumAsync({1, 2, 3});
+        QVERIFY(!echo.IsFinished());
+        QVERIFY(!echo.IsError());
+        echo.WaitForFinished();
+        QVERIFY_EXCEPTION_THROWN(echo.Value(), hardbus::Exception);
+        access_->SendBatch();
+        QCOMPARE(echo.Value(), 1);
+        QCOMPARE(sum.Value(), 6);
+        QVERIFY(echo.IsFinished());
+    }
+
+    void BatchIsSentWhenDestroyed()
+    {
+        std::vector<hardbus::PendingReply<int>> replies;
+        {
+            hardbus::Batch<TestDefinition::Access> batch{access_};
+            for (int i = 0; i < 100; ++i) {
+                replies.push_back(access_->EchoAsync(i));
+            }
+        }
+        for (int i = 0; i < 100; ++i) {
+            QCOMPARE(replies[i].Value(), i);
+        }
+    }
+
+    void FailingCallFailsItsReplyOnly()
+    {
+        access_->BeginBatch();
+        auto before = access_->EchoAsync(1);
+        auto fail = access_->FailAsync(2);
+        auto after = access_->EchoAsync(3);
+        access_->SendBatch();
+        QCOMPARE(before.Value(), 1);
+        QVERIFY_EXCEPTION_THROWN(fail.Value(), hardbus::Exception);
+        QCOMPARE(after.Value(), 3);
+    }
+
+    void ThenWaitsForTheBatch()
+    {
+        int result = -1;
+        access_->BeginBatch();
+        access_->EchoAsync(5).Then(this, [&result](hardbus::PendingReply<int> reply) { result = reply.Value(); });
+        QTest::qWait(100);
+        QCOMPARE(result, -1);
+        access_->SendBatch();
+        QTRY_COMPARE(result, 5);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+    TestDefinition::Access *access_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(BatchTest)
+#include "batch_test.moc"
@@ -0,0 +1,130 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Result cache of `cached` functions: time to live, invalidation by signals,
+// results invalidated while they are computed and sweeping of expired entries
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class CacheTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+        access_ = qobject_cast<TestDefinition::Access *>(remote_);
+        QVERIFY(access_);
+    }
+
+    void init() { access_->ClearCache(); }
+
+    void ResultIsReusedWithinTtl()
+    {
+        const auto before = access_->CacheStats();
+        const int counter = remote_->Counter();
+        remote_->Echo(1);
+        QCOMPARE(remote_->Counter(), counter);
+        const auto after = access_->CacheStats();
+        QCOMPARE(after.misses - before.misses, quint64(1));
+        QCOMPARE(after.hits - before.hits, quint64(1));
+    }
+
+    void ResultExpiresAfterTtl()
+    {
+        const int counter = remote_->Counter();
+        remote_->Echo(1);
+        QTest::qWait(counter_ttl_ms + 50);
+        const auto before = access_->CacheStats();
+        QCOMPARE(remote_->Counter(), counter + 1);
+        const auto after = access_->CacheStats();
+        QCOMPARE(after.misses - before.misses, quint64(1));
+        QCOMPARE(after.evictions - before.evictions, quint64(1));
+    }
+
+    void SignalInvalidatesResult()
+    {
+        QSignalSpy changed{remote_, &ITest::CounterChanged};
+        const int counter = remote_->Counter();
+        remote_->Bump();
+        QTRY_COMPARE(changed.count(), 1);
+        QCOMPARE(remote_->Counter(), counter + 1);
+    }
+
+    void ClearCacheDropsResults()
+    {
+        const int counter = remote_->Counter();
+        remote_->Echo(1);
+        access_->ClearCache();
+        QCOMPARE(remote_->Counter(), counter + 1);
+    }
+
+    void ResultInvalidatedWhileComputedIsNotStored()
+    {
+        hardbus::internal::CallCache cache;
+        const auto key = hardbus::internal::CacheKey(1);
+        QCOMPARE(cache.Get<int>("f", 10000, key, [&] {
+            cache.Invalidate("f");
+            return 1;
+        }),
+                 1);
+        QCOMPARE(cache.Get<int>("f", 10000, key, [] { return 2; }), 2);
+        QCOMPARE(cache.Get<int>("f", 10000, key, [] { return 3; }), 2);
+        QCOMPARE(cache.Stats().misses, quint64(2));
+        QCOMPARE(cache.Stats().hits, quint64(1));
+    }
+
+    void ExpiredEntriesAreSwept()
+    {
+        hardbus::internal::CallCache cache;
+        for (int i = 0; i < 16; ++i) {
+            cache.Get<int>("f", 0, hardbus::internal::CacheKey(i), [i] { return i; });
+        }
+        QCOMPARE(cache.Stats().evictions, quint64(0));
+        cache.Get<int>("f", 10000, hardbus::internal::CacheKey(16), [] { return 16; });
+        QCOMPARE(cache.Stats().evictions, quint64(16));
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+    TestDefinition::Access *access_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(CacheTest)
+#include "cache_test.moc"
@@ -0,0 +1,122 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Compression of `compressed` functions: the threshold, the round trip of the
+// payloads, corrupt payloads and the compressed sizes in the metrics
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <algorithm>
+
+class CompressionTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+    }
+
+    void init() { TestDefinition::Metrics().Reset(); }
+
+    void cleanup() { hardbus::SetCompressionThreshold(1024); }
+
+    void SmallPayloadIsNotCompressed()
+    {
+        const QByteArray data(10, 'x');
+        const auto payload = hardbus::internal::Compress(data);
+        QVERIFY(!payload.compressed);
+        QCOMPARE(payload.data, data);
+        QCOMPARE(hardbus::internal::Decompress(payload), data);
+    }
+
+    void LargePayloadRoundTrip()
+    {
+        const QByteArray data(4096, 'x');
+        const auto payload = hardbus::internal::Compress(data);
+        QVERIFY(payload.compressed);
+        QVERIFY(payload.data.size() < data.size());
+        QCOMPARE(hardbus::internal::Decompress(payload), data);
+    }
+
+    void ThresholdIsConfigurable()
+    {
+        hardbus::SetCompressionThreshold(16);
+        QVERIFY(hardbus::internal::Compress(QByteArray(32, 'x')).compressed);
+        QVERIFY(!hardbus::internal::Compress(QByteArray(8, 'x')).compressed);
+    }
+
+    void CorruptPayloadThrows()
+    {
+        hardbus::internal::CompressedPayload payload;
+        payload.compressed = true;
+        payload.data = QByteArrayLiteral("garbage");
+        QVERIFY_EXCEPTION_THROWN(hardbus::internal::Decompress(payload), hardbus::Exception);
+    }
+
+    void StringRoundTripOverBus()
+    {
+        QCOMPARE(remote_->Repeat({QStringLiteral("a")}, 3).value, QStringLiteral("aaa"));
+        const auto text = remote_->Repeat({QStringLiteral("hardbus ")}, 1000).value;
+        QCOMPARE(text, QStringLiteral("hardbus ").repeated(1000));
+        const auto &repeat = TestDefinition::Metrics().Import(QStringLiteral("Repeat"));
+        QVERIFY(repeat.compressed_bytes > 0);
+        QVERIFY(repeat.compressed_bytes < repeat.uncompressed_bytes);
+    }
+
+    void BinaryRoundTripOverBus()
+    {
+        Samples samples;
+        for (int i = 0; i < 2000; ++i) {
+            samples.values.append(i % 10);
+        }
+        auto reversed = samples.values;
+        std::reverse(reversed.begin(), reversed.end());
+        QCOMPARE(remote_->Reverse(samples).values, reversed);
+        const auto &reverse = TestDefinition::Metrics().Import(QStringLiteral("Reverse"));
+        QVERIFY(reverse.compressed_bytes > 0);
+        QVERIFY(reverse.compressed_bytes < reverse.uncompressed_bytes);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(CompressionTest)
+#include "compression_test.moc"
@@ -0,0 +1,114 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Calls dispatched on a thread pool: exceptions become error replies, a slow
+// call does not hold back other functions, and destroying the export waits for
+// the running calls and fails the queued ones
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <chrono>
+#include <thread>
+
+class DispatchTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        pool_.setMaxThreadCount(2);
+        hardbus::ExportOptions options;
+        options.dispatch_pool = &pool_;
+        TestDefinition::RegisterService(&service_, options);
+        // calls from another connection, so they go through the bus to the pool
+        client_ = QDBusConnection::connectToBus(QString::fromUtf8(bus_.Address()), QStringLiteral("dispatch-client"));
+        QVERIFY(client_.isConnected());
+    }
+
+    void ExceptionBecomesErrorReply()
+    {
+        auto fail = Call(QStringLiteral("Fail"), {1});
+        QTRY_VERIFY(fail.isFinished());
+        QVERIFY(fail.isError());
+        QVERIFY(fail.error().message().contains(QLatin1String("Fail(1)")));
+        QCOMPARE(Value(Call(QStringLiteral("Echo"), {2})), 2);
+    }
+
+    void DestroyedExportFailsQueuedCalls()
+    {
+        auto running = Call(QStringLiteral("Hold"), {1});
+        QTRY_COMPARE(service_.Holding(), 1);
+        // calls to the same function run one at a time, so this one waits
+        auto queued = Call(QStringLiteral("Hold"), {2});
+        // other functions are not held back, and once this reply is here the queued call is
+        QCOMPARE(Value(Call(QStringLiteral("Echo"), {3})), 3);
+        QVERIFY(!running.isFinished());
+
+        std::thread opener{[this] {
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+            service_.Open();
+        }};
+        delete service_.findChild<TestDefinition::TraitsForTestDefinition::dbus_export *>();
+        opener.join();
+
+        QTRY_VERIFY(running.isFinished() && queued.isFinished());
+        QCOMPARE(Value(running), 1);
+        QVERIFY(queued.isError());
+        QCOMPARE(queued.error().type(), QDBusError::UnknownObject);
+    }
+
+    void cleanupTestCase() { QDBusConnection::disconnectFromBus(QStringLiteral("dispatch-client")); }
+
+private:
+    QDBusPendingCall Call(const QString &member, const QVariantList &arguments)
+    {
+        auto message = QDBusMessage::createMethodCall(TestDefinition::ServiceName(),
+                                                      TestDefinition::ServicePath(),
+                                                      TestDefinition::ServiceInterface(),
+                                                      member);
+        message.setArguments(arguments);
+        return client_.asyncCall(message);
+    }
+
+    static int Value(const QDBusPendingCall &call)
+    {
+        QDBusPendingReply<int> reply = call;
+        reply.waitForFinished();
+        return reply.isValid() ? reply.value() : -1;
+    }
+
+    PrivateBus bus_;
+    // outlives the export, which waits for the calls running in it
+    QThreadPool pool_;
+    TestService service_;
+    QDBusConnection client_{QStringLiteral("dispatch-client")};
+};
+
+QTEST_GUILESS_MAIN(DispatchTest)
+#include "dispatch_test.moc"
@@ -0,0 +1,80 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Signals throttled by the service: `batched` emissions arrive unpacked, all
+// of them and in order, and `latest` emissions are coalesced to the most recent
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class EmissionTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+    }
+
+    void BatchedEmissionsArriveInOrder()
+    {
+        QSignalSpy samples{remote_, &ITest::Sample};
+        // the match rule is added before this call reaches the bus
+        QCOMPARE(remote_->Echo(1), 1);
+        remote_->Emit(10);
+        QTRY_COMPARE(samples.count(), 10);
+        for (int i = 0; i < 10; ++i) {
+            QCOMPARE(samples.at(i).first().toInt(), i);
+        }
+    }
+
+    void LatestEmissionIsKept()
+    {
+        QSignalSpy progress{remote_, &ITest::Progress};
+        QCOMPARE(remote_->Echo(1), 1);
+        remote_->Emit(10);
+        QTRY_VERIFY(!progress.isEmpty() && progress.last().first().toInt() == 9);
+        QVERIFY(progress.count() < 10);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(EmissionTest)
+#include "emission_test.moc"
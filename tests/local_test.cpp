@@ -0,0 +1,124 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Services exported by the same process: access objects call the
+// implementation directly, queue one-way calls, wait for implementations
+// living in other threads and fail calls queued to a service deleted meanwhile
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <memory>
+
+class LocalTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase() { QVERIFY(bus_.Start()); }
+
+    void CallsGoDirectly()
+    {
+        TestService service;
+        TestDefinition::RegisterService(&service);
+        std::unique_ptr<ITest> remote{TestDefinition::CreateAndConnectService()};
+        QVERIFY(!qobject_cast<TestDefinition::Access *>(remote.get())->RemoteInterface());
+        QCOMPARE(remote->Echo(5), 5);
+        QCOMPARE(remote->Sum({1, 2, 3}), 6);
+        QCOMPARE(service.Counter(), 2);
+        QCOMPARE(remote->Level(), 7);
+        QVERIFY_EXCEPTION_THROWN(remote->Fail(1), hardbus::Exception);
+    }
+
+    void SignalsAreForwarded()
+    {
+        TestService service;
+        TestDefinition::RegisterService(&service);
+        std::unique_ptr<ITest> remote{TestDefinition::CreateAndConnectService()};
+        QSignalSpy changed{remote.get(), &ITest::CounterChanged};
+        QSignalSpy level{remote.get(), &ITest::LevelChanged};
+        remote->Bump();
+        QCOMPARE(changed.count(), 1);
+        remote->SetLevel(9);
+        QCOMPARE(level.count(), 1);
+        QCOMPARE(remote->Level(), 9);
+    }
+
+    void OnewayCallIsQueued()
+    {
+        TestService service;
+        TestDefinition::RegisterService(&service);
+        std::unique_ptr<ITest> remote{TestDefinition::CreateAndConnectService()};
+        remote->Store(1);
+        QVERIFY(remote->Stored().isEmpty());
+        QTRY_COMPARE(remote->Stored(), QList<int>{1});
+    }
+
+    void ServiceInAnotherThread()
+    {
+        QThread worker;
+        worker.start();
+        auto service = new TestService;
+        TestDefinition::RegisterService(service);
+        service->moveToThread(&worker);
+        std::unique_ptr<ITest> remote{TestDefinition::CreateAndConnectService()};
+        auto access = qobject_cast<TestDefinition::Access *>(remote.get());
+        QCOMPARE(remote->Echo(5), 5);
+        auto reply = access->EchoAsync(6);
+        reply.WaitForFinished();
+        QCOMPARE(reply.Value(), 6);
+        auto failed = access->FailAsync(7);
+        failed.WaitForFinished();
+        QVERIFY(failed.IsError());
+        QVERIFY(failed.Error().message().contains(QLatin1String("Fail(7)")));
+        QMetaObject::invokeMethod(service, [service] { delete service; }, Qt::BlockingQueuedConnection);
+        worker.quit();
+        worker.wait();
+    }
+
+    void ServiceDeletedBeforeQueuedCall()
+    {
+        // never started, so the queued call cannot run before the service goes away
+        QThread worker;
+        auto service = new TestService;
+        TestDefinition::RegisterService(service);
+        service->moveToThread(&worker);
+        std::unique_ptr<ITest> remote{TestDefinition::CreateAndConnectService()};
+        auto reply = qobject_cast<TestDefinition::Access *>(remote.get())->EchoAsync(1);
+        QVERIFY(!reply.IsFinished());
+        delete service;
+        QVERIFY(reply.IsFinished());
+        QVERIFY(reply.IsError());
+        QCOMPARE(reply.Error().message(), QStringLiteral("service is gone"));
+        QVERIFY_EXCEPTION_THROWN(reply.Value(), hardbus::Exception);
+    }
+
+private:
+    PrivateBus bus_;
+};
+
+QTEST_GUILESS_MAIN(LocalTest)
+#include "local_test.moc"
@@ -0,0 +1,117 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Metrics of the access side: calls, failed blocking and asynchronous replies
+// of a service running its calls on a thread pool, and histogram percentiles
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class MetricsTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start({QStringLiteral("--pool")}));
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+        access_ = qobject_cast<TestDefinition::Access *>(remote_);
+        QVERIFY(access_);
+    }
+
+    void init() { TestDefinition::Metrics().Reset(); }
+
+    void CallsAreCounted()
+    {
+        for (int i = 0; i < 5; ++i) {
+            QCOMPARE(remote_->Echo(i), i);
+        }
+        const auto &echo = TestDefinition::Metrics().Import(QStringLiteral("Echo"));
+        QCOMPARE(echo.calls.load(), quint64(5));
+        QCOMPARE(echo.errors.load(), quint64(0));
+        QCOMPARE(echo.round_trip.Count(), quint64(5));
+    }
+
+    void FailedBlockingCallIsCounted()
+    {
+        QCOMPARE(remote_->Fail(1), 0);
+        const auto &fail = TestDefinition::Metrics().Import(QStringLiteral("Fail"));
+        QCOMPARE(fail.calls.load(), quint64(1));
+        QCOMPARE(fail.errors.load(), quint64(1));
+    }
+
+    void FailedAsynchronousCallIsCounted()
+    {
+        auto reply = access_->FailAsync(2);
+        reply.WaitForFinished();
+        QVERIFY(reply.IsError());
+        QVERIFY(reply.Error().message().contains(QLatin1String("Fail(2)")));
+        QVERIFY_EXCEPTION_THROWN(reply.Value(), hardbus::Exception);
+        // counted by a watcher in the thread of the access object
+        QTRY_COMPARE(TestDefinition::Metrics().Import(QStringLiteral("Fail")).errors.load(), quint64(1));
+    }
+
+    void ServiceKeepsServingAfterFailures()
+    {
+        remote_->Fail(3);
+        QCOMPARE(remote_->Echo(4), 4);
+    }
+
+    void HistogramPercentiles()
+    {
+        hardbus::Histogram histogram;
+        QCOMPARE(histogram.Percentile(0.5), qint64(0));
+        for (int ns = 1; ns <= 1000; ++ns) {
+            histogram.Record(ns);
+        }
+        QCOMPARE(histogram.Count(), quint64(1000));
+        // upper bounds of the buckets, at most 12.5% above the value
+        const auto p50 = histogram.Percentile(0.5);
+        QVERIFY2(p50 >= 500 && p50 <= 563, QByteArray::number(p50));
+        const auto p100 = histogram.Percentile(1);
+        QVERIFY2(p100 >= 1000 && p100 <= 1125, QByteArray::number(p100));
+        histogram.Reset();
+        QCOMPARE(histogram.Count(), quint64(0));
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+    TestDefinition::Access *access_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(MetricsTest)
+#include "metrics_test.moc"
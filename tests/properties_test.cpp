@@ -0,0 +1,128 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Properties: the access object reads its copy, fetched when it connects and
+// updated by PropertiesChanged. APIs without properties still take two macros
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class IPlain : public QObject
+{
+    Q_OBJECT
+public:
+    using QObject::QObject;
+
+    virtual int Echo(int v) = 0;
+
+signals:
+    void Echoed(int v);
+};
+
+class Plain : public IPlain
+{
+    Q_OBJECT
+public:
+    int Echo(int v) override
+    {
+        emit Echoed(v);
+        return v;
+    }
+};
+
+#define PLAIN_SERVICE_API(FUNC, SIG) \
+    FUNC(int, Echo, (int)) \
+    SIG(void, Echoed, (int))
+
+HARDBUS_DEFINE_SERVICE(PlainDefinition,
+                       IPlain,
+                       PLAIN_SERVICE_API,
+                       "com.hardbus.TestPlain",
+                       "/com/hardbus/TestPlain",
+                       "com.hardbus.TestPlain",
+                       QDBusConnection::sessionBus())
+
+class PropertiesTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+    }
+
+    void ValueIsFetchedOnConnect() { QCOMPARE(remote_->Level(), 7); }
+
+    void ChangeIsPushed()
+    {
+        QSignalSpy changed{remote_, &ITest::LevelChanged};
+        remote_->SetLevel(9);
+        QTRY_COMPARE(changed.count(), 1);
+        QCOMPARE(changed.first().first().toInt(), 9);
+        QCOMPARE(remote_->Level(), 9);
+        remote_->SetLevel(7);
+        QTRY_COMPARE(remote_->Level(), 7);
+    }
+
+    void NewAccessObjectGetsCurrentValue()
+    {
+        remote_->SetLevel(11);
+        std::unique_ptr<ITest> other{TestDefinition::CreateServiceInterface()};
+        QVERIFY(TestDefinition::WaitAndConnectService(other.get(), 10000));
+        QCOMPARE(other->Level(), 11);
+        remote_->SetLevel(7);
+    }
+
+    void ApiWithoutProperties()
+    {
+        Plain plain;
+        PlainDefinition::RegisterService(&plain);
+        std::unique_ptr<IPlain> access{PlainDefinition::CreateAndConnectService()};
+        QSignalSpy echoed{access.get(), &IPlain::Echoed};
+        QCOMPARE(access->Echo(3), 3);
+        QCOMPARE(echoed.count(), 1);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(PropertiesTest)
+#include "properties_test.moc"
+
+HARDBUS_DEFINE_SERVICE_IMPL(PlainDefinition)
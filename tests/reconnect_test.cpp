@@ -0,0 +1,114 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Restarts of the service: calls fail while it is gone unless they are queued,
+// queued blocking and asynchronous calls complete once it is back, and waiting
+// for a service that never comes times out
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class ReconnectTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+        access_ = qobject_cast<TestDefinition::Access *>(remote_);
+        QVERIFY(access_);
+    }
+
+    void init() { access_->QueueCallsWhileDisconnected(0); }
+
+    void CallsFailWhileServiceIsGone()
+    {
+        server_.Stop();
+        QTRY_VERIFY(!access_->RemoteInterface());
+        QVERIFY_EXCEPTION_THROWN(remote_->Echo(1), hardbus::Exception);
+        QVERIFY(server_.Start());
+        QTRY_VERIFY(access_->RemoteInterface());
+        QCOMPARE(remote_->Echo(2), 2);
+    }
+
+    void BlockingCallWaitsForRestart()
+    {
+        access_->QueueCallsWhileDisconnected(10000);
+        server_.Stop();
+        QTRY_VERIFY(!access_->RemoteInterface());
+        server_.Launch();
+        // waits in a helper thread, this one runs no event loop meanwhile
+        QCOMPARE(remote_->Echo(3), 3);
+        QVERIFY(access_->RemoteInterface());
+        QVERIFY(server_.WaitUntilReady());
+    }
+
+    void AsynchronousCallIsQueuedUntilRestart()
+    {
+        access_->QueueCallsWhileDisconnected(10000);
+        server_.Stop();
+        QTRY_VERIFY(!access_->RemoteInterface());
+        auto reply = access_->EchoAsync(4);
+        QVERIFY(!reply.IsFinished());
+        QVERIFY(server_.Start());
+        QTRY_VERIFY(reply.IsFinished());
+        QCOMPARE(reply.Value(), 4);
+    }
+
+    void WaitForRegisteredService()
+    {
+        QVERIFY(hardbus::WaitForServiceRegistration(
+            QString{TestDefinition::ServiceName()}, QDBusConnection::sessionBus(), 1000));
+    }
+
+    void WaitForMissingServiceTimesOut()
+    {
+        QElapsedTimer elapsed;
+        elapsed.start();
+        QVERIFY(!hardbus::WaitForServiceRegistration(
+            QStringLiteral("com.hardbus.Missing"), QDBusConnection::sessionBus(), 200));
+        QVERIFY(elapsed.elapsed() >= 190);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+    TestDefinition::Access *access_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(ReconnectTest)
+#include "reconnect_test.moc"
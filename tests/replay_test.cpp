@@ -0,0 +1,111 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Traffic capture and replay: calls recorded by the service are read back,
+// replayed against a new service, and broken logs are refused or cut short
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class ReplayTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(dir_.isValid());
+        QVERIFY(bus_.Start());
+    }
+
+    void CallsAreRecorded()
+    {
+        QVERIFY(server_.Start({QStringLiteral("--record"), Log()}));
+        {
+            std::unique_ptr<ITest> remote{TestDefinition::CreateServiceInterface()};
+            QVERIFY(TestDefinition::WaitAndConnectService(remote.get(), 10000));
+            for (int i = 0; i < 20; ++i) {
+                QCOMPARE(remote->Echo(i), i);
+            }
+        }
+        // the log is complete once the server is gone
+        server_.Stop();
+        int echoes = 0;
+        for (const auto &record : hardbus::internal::ReadTrafficLog(Log())) {
+            echoes += record.function == "Echo";
+        }
+        QCOMPARE(echoes, 20);
+    }
+
+    void RecordedCallsAreReplayed()
+    {
+        const auto recorded = int(hardbus::internal::ReadTrafficLog(Log()).size());
+        QVERIFY(server_.Start());
+        hardbus::ReplayOptions options;
+        options.speed = 0;
+        const auto report = TestDefinition::ReplayTraffic(Log(), options);
+        QCOMPARE(report.value(QStringLiteral("calls")).toInt(), recorded);
+        QCOMPARE(report.value(QStringLiteral("errors")).toInt(), 0);
+        QVERIFY(report.contains(QStringLiteral("latency")));
+        server_.Stop();
+    }
+
+    void TruncatedLogIsCutShort()
+    {
+        QFile log{Log()};
+        QVERIFY(log.open(QIODevice::ReadOnly));
+        const auto data = log.readAll();
+        const auto truncated = dir_.filePath(QStringLiteral("truncated.log"));
+        QFile out{truncated};
+        QVERIFY(out.open(QIODevice::WriteOnly));
+        out.write(data.left(data.size() - 3));
+        out.close();
+        const auto all = hardbus::internal::ReadTrafficLog(Log()).size();
+        QCOMPARE(hardbus::internal::ReadTrafficLog(truncated).size(), all - 1);
+    }
+
+    void OtherFileIsRefused()
+    {
+        const auto path = dir_.filePath(QStringLiteral("other.log"));
+        QFile file{path};
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write("not a traffic log");
+        file.close();
+        QVERIFY_EXCEPTION_THROWN(hardbus::internal::ReadTrafficLog(path), hardbus::Exception);
+        QVERIFY_EXCEPTION_THROWN(hardbus::internal::ReadTrafficLog(dir_.filePath(QStringLiteral("missing.log"))),
+                                 hardbus::Exception);
+    }
+
+private:
+    QString Log() const { return dir_.filePath(QStringLiteral("traffic.log")); }
+
+    QTemporaryDir dir_;
+    PrivateBus bus_;
+    TestServer server_;
+};
+
+QTEST_GUILESS_MAIN(ReplayTest)
+#include "replay_test.moc"
@@ -0,0 +1,139 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Streamed results: record framing and its size bounds, values arriving in
+// order over the bus, and producers abandoned by their reader
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+class StreamTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+    }
+
+    void RecordsRoundTrip()
+    {
+        QByteArray records;
+        hardbus::internal::AppendStreamRecord(records, QStringLiteral("first"));
+        hardbus::internal::AppendStreamRecord(records, QString{});
+        hardbus::internal::AppendStreamRecord(records, QStringLiteral("third"));
+        hardbus::Stream<QString> stream{std::unique_ptr<hardbus::internal::StreamSource<QString>>{
+            new hardbus::internal::BytesStreamSource<QString>{records}}};
+        // copies share their position
+        const auto copy = stream;
+        QString value;
+        QVERIFY(stream.Next(value));
+        QCOMPARE(value, QStringLiteral("first"));
+        QVERIFY(copy.Next(value));
+        QCOMPARE(value, QString{});
+        QVERIFY(stream.Next(value));
+        QCOMPARE(value, QStringLiteral("third"));
+        QVERIFY(!stream.Next(value));
+        QVERIFY(!hardbus::Stream<QString>{}.Next(value));
+    }
+
+    void TruncatedRecordThrows()
+    {
+        QByteArray records;
+        hardbus::internal::AppendStreamRecord(records, 1);
+        hardbus::internal::AppendStreamRecord(records, 2);
+        records.chop(1);
+        hardbus::internal::BytesStreamSource<int> source{records};
+        int value = 0;
+        QVERIFY(source.Next(value));
+        QCOMPARE(value, 1);
+        QVERIFY_EXCEPTION_THROWN(source.Next(value), hardbus::Exception);
+    }
+
+    void OversizedRecordThrows()
+    {
+        QByteArray records(4, '\0');
+        qToBigEndian(hardbus::internal::max_stream_record_size + 1, records.data());
+        records.append(16, '\0');
+        hardbus::internal::BytesStreamSource<int> source{records};
+        int value = 0;
+        QVERIFY_EXCEPTION_THROWN(source.Next(value), hardbus::Exception);
+    }
+
+    void ValuesArriveInOrder()
+    {
+        auto range = remote_->Range(1000);
+        int value = -1;
+        int expected = 0;
+        while (range.Next(value)) {
+            QCOMPARE(value, expected);
+            ++expected;
+        }
+        QCOMPARE(expected, 1000);
+        QVERIFY(!remote_->Range(0).Next(value));
+    }
+
+    void LargeValuesArrive()
+    {
+        auto chunks = remote_->Chunks(50, 100000);
+        QByteArray chunk;
+        int count = 0;
+        while (chunks.Next(chunk)) {
+            QCOMPARE(chunk, QByteArray(100000, char('a' + count % 26)));
+            ++count;
+        }
+        QCOMPARE(count, 50);
+    }
+
+    void AbandonedStreamKeepsServiceServing()
+    {
+        for (int i = 0; i < 3; ++i) {
+            auto range = remote_->Range(1000000);
+            int value = -1;
+            QVERIFY(range.Next(value));
+            QCOMPARE(value, 0);
+        }
+        QCOMPARE(remote_->Echo(1), 1);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(StreamTest)
+#include "stream_test.moc"
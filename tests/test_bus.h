@@ -0,0 +1,121 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Private dbus-daemon and hardbus_test_server for the tests, so no system or
+// session bus is needed and calls really go through the bus
+
+#pragma once
+#include <QDebug>
+#include <QProcess>
+#include <QTemporaryDir>
+
+#include <memory>
+
+//! dbus-daemon listening in a temporary directory. Start() makes it the session bus
+//! of the process, so it must run before the session bus is first used
+class PrivateBus
+{
+public:
+    ~PrivateBus()
+    {
+        daemon_.terminate();
+        daemon_.waitForFinished();
+    }
+
+    bool Start()
+    {
+        daemon_.start(QStringLiteral("dbus-daemon"),
+                      {QStringLiteral("--session"),
+                       QStringLiteral("--nofork"),
+                       QStringLiteral("--print-address"),
+                       QStringLiteral("--address=unix:tmpdir=") + dir_.path()});
+        if (!daemon_.waitForStarted() || !daemon_.waitForReadyRead()) {
+            qWarning() << "Cannot start dbus-daemon" << daemon_.errorString();
+            return false;
+        }
+        address_ = daemon_.readLine().trimmed();
+        if (address_.isEmpty()) {
+            return false;
+        }
+        qputenv("DBUS_SESSION_BUS_ADDRESS", address_);
+        return true;
+    }
+
+    QByteArray Address() const { return address_; }
+
+private:
+    QTemporaryDir dir_;
+    QProcess daemon_;
+    QByteArray address_;
+};
+
+//! hardbus_test_server in a child process. It serves until its standard input is closed
+class TestServer
+{
+public:
+    ~TestServer() { Stop(); }
+
+    //! Starts the server with \a args and waits until its services are registered
+    bool Start(const QStringList &args = {})
+    {
+        Launch(args);
+        return WaitUntilReady();
+    }
+
+    //! Starts the server with \a args without waiting for it
+    void Launch(const QStringList &args = {})
+    {
+        Stop();
+        process_.reset(new QProcess);
+        process_->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        process_->start(QStringLiteral(HARDBUS_TEST_SERVER), args);
+    }
+
+    //! Waits until the services of a launched server are registered
+    bool WaitUntilReady()
+    {
+        if (!process_->waitForStarted() || (!process_->canReadLine() && !process_->waitForReadyRead(30000))) {
+            qWarning() << "Test server did not start" << process_->errorString();
+            return false;
+        }
+        return process_->readLine().trimmed() == "ready";
+    }
+
+    //! Lets the server quit, so its traffic log is complete
+    void Stop()
+    {
+        if (!process_) {
+            return;
+        }
+        process_->closeWriteChannel();
+        if (!process_->waitForFinished(10000)) {
+            process_->kill();
+            process_->waitForFinished();
+        }
+        process_.reset();
+    }
+
+private:
+    std::unique_ptr<QProcess> process_;
+};
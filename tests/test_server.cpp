@@ -0,0 +1,69 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Serves TestDefinition for the tests until its standard input is closed.
+//
+// usage: hardbus_test_server [--pool] [--record <traffic.log>] [--tree]
+//
+// --pool runs the calls on a thread pool, --record writes them to a traffic
+// log and --tree also exports TreeDefinition with an object per `dev` id.
+
+#include "test_service.h"
+
+#include <QSocketNotifier>
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app{argc, argv};
+    const auto args = app.arguments();
+
+    // outlives the export, which waits for the calls running in it
+    QThreadPool pool;
+    TestService service;
+    hardbus::ExportOptions options;
+    if (args.contains(QStringLiteral("--pool"))) {
+        options.dispatch_pool = &pool;
+    }
+    const int record_index = args.indexOf(QStringLiteral("--record"));
+    if (record_index > 0) {
+        options.recorder = std::make_shared<hardbus::TrafficRecorder>(args.value(record_index + 1));
+    }
+    TestDefinition::RegisterService(&service, options);
+
+    if (args.contains(QStringLiteral("--tree"))) {
+        hardbus::ObjectTreeOptions<ITest> tree;
+        tree.factory = [](const QString &id) -> ITest * { return IsTreeId(id) ? new TestService{id} : nullptr; };
+        tree.list = [] { return QStringList{QStringLiteral("dev0")}; };
+        tree.idle_timeout_ms = tree_idle_timeout_ms;
+        TreeDefinition::RegisterServiceTree(tree);
+    }
+
+    QSocketNotifier input_closed{0, QSocketNotifier::Read};
+    QObject::connect(&input_closed, &QSocketNotifier::activated, &app, &QCoreApplication::quit);
+
+    QTextStream out{stdout};
+    out << "ready\n";
+    out.flush();
+    return app.exec();
+}
@@ -0,0 +1,152 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+#include "test_service.h"
+
+#include <algorithm>
+#include <numeric>
+
+TestService::TestService(const QString &name, QObject *parent) : ITest{parent}
+{
+    setObjectName(name);
+}
+
+int TestService::Echo(int v)
+{
+    ++counter_;
+    return v;
+}
+
+int TestService::Sum(QList<int> values)
+{
+    ++counter_;
+    return std::accumulate(values.begin(), values.end(), 0);
+}
+
+QString TestService::Name() const
+{
+    return objectName();
+}
+
+int TestService::Counter()
+{
+    return counter_;
+}
+
+void TestService::Bump()
+{
+    ++counter_;
+    emit CounterChanged();
+}
+
+int TestService::Fail(int v)
+{
+    throw hardbus::Exception{QStringLiteral("Fail(%1)").arg(v)};
+}
+
+int TestService::Hold(int v)
+{
+    ++holding_;
+    gate_.acquire();
+    gate_.release();
+    --holding_;
+    return v;
+}
+
+void TestService::Store(int v)
+{
+    QMutexLocker lock{&stored_mutex_};
+    stored_.append(v);
+}
+
+QList<int> TestService::Stored()
+{
+    QMutexLocker lock{&stored_mutex_};
+    return stored_;
+}
+
+Text TestService::Repeat(Text text, int times)
+{
+    return {text.value.repeated(times)};
+}
+
+Samples TestService::Reverse(Samples samples)
+{
+    std::reverse(samples.values.begin(), samples.values.end());
+    return samples;
+}
+
+hardbus::Stream<int> TestService::Range(int count)
+{
+    return hardbus::Stream<int>{[count](const hardbus::Stream<int>::Writer &write) {
+        for (int i = 0; i < count; ++i) {
+            if (!write(i)) {
+                return;
+            }
+        }
+    }};
+}
+
+hardbus::Stream<QByteArray> TestService::Chunks(int count, int size)
+{
+    return hardbus::Stream<QByteArray>{[count, size](const hardbus::Stream<QByteArray>::Writer &write) {
+        for (int i = 0; i < count; ++i) {
+            if (!write(QByteArray(size, char('a' + i % 26)))) {
+                return;
+            }
+        }
+    }};
+}
+
+void TestService::Emit(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        emit Progress(i);
+        emit Sample(i);
+    }
+}
+
+int TestService::Level() const
+{
+    return level_;
+}
+
+void TestService::SetLevel(int level)
+{
+    level_ = level;
+    emit LevelChanged(level);
+}
+
+void TestService::Open()
+{
+    gate_.release();
+}
+
+int TestService::Holding() const
+{
+    return holding_;
+}
+
+HARDBUS_DEFINE_SERVICE_IMPL(TestDefinition)
+HARDBUS_DEFINE_SERVICE_IMPL(TreeDefinition)
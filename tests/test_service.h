@@ -0,0 +1,191 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Service the tests call, in this process or in hardbus_test_server
+
+#pragma once
+#include "hardbus.h"
+
+#include <QSemaphore>
+
+//! Sent as a string, so `compressed` functions compress it
+struct Text
+{
+    QString value;
+};
+
+//! Sent as bytes, so `compressed` functions compress it
+struct Samples
+{
+    QVector<int> values;
+};
+
+inline QDataStream &operator<<(QDataStream &stream, const Samples &v)
+{
+    return stream << v.values;
+}
+
+inline QDataStream &operator>>(QDataStream &stream, Samples &v)
+{
+    return stream >> v.values;
+}
+
+namespace hardbus
+{
+template<>
+struct ProxyStringConverter<Text>
+{
+    QString ToString(const Text &v) { return v.value; }
+    Text FromString(const QString &v) { return {v}; }
+};
+
+template<>
+struct ProxyBinaryConverter<Samples> : DataStreamBinaryConverter<Samples>
+{};
+} // namespace hardbus
+
+class ITest : public QObject
+{
+    Q_OBJECT
+public:
+    using QObject::QObject;
+
+    virtual int Echo(int v) = 0;
+    virtual int Sum(QList<int> values) = 0;
+    //! Name of the object, its id in a service tree
+    virtual QString Name() const = 0;
+    //! Number of calls served so far
+    virtual int Counter() = 0;
+    //! Emits CounterChanged
+    virtual void Bump() = 0;
+    //! Throws hardbus::Exception
+    virtual int Fail(int v) = 0;
+    //! Returns \a v once the gate of the service is open
+    virtual int Hold(int v) = 0;
+    virtual void Store(int v) = 0;
+    virtual QList<int> Stored() = 0;
+    virtual Text Repeat(Text text, int times) = 0;
+    virtual Samples Reverse(Samples samples) = 0;
+    //! 0 to \a count - 1
+    virtual hardbus::Stream<int> Range(int count) = 0;
+    //! \a count arrays of \a size bytes
+    virtual hardbus::Stream<QByteArray> Chunks(int count, int size) = 0;
+    //! Emits Progress and Sample with 0 to \a count - 1
+    virtual void Emit(int count) = 0;
+    virtual int Level() const = 0;
+    virtual void SetLevel(int level) = 0;
+
+signals:
+    void CounterChanged();
+    void Progress(int value);
+    void Sample(int value);
+    void LevelChanged(int level);
+};
+
+class TestService : public ITest
+{
+    Q_OBJECT
+public:
+    explicit TestService(const QString &name = QStringLiteral("service"), QObject *parent = nullptr);
+
+    int Echo(int v) override;
+    int Sum(QList<int> values) override;
+    QString Name() const override;
+    int Counter() override;
+    void Bump() override;
+    int Fail(int v) override;
+    int Hold(int v) override;
+    void Store(int v) override;
+    QList<int> Stored() override;
+    Text Repeat(Text text, int times) override;
+    Samples Reverse(Samples samples) override;
+    hardbus::Stream<int> Range(int count) override;
+    hardbus::Stream<QByteArray> Chunks(int count, int size) override;
+    void Emit(int count) override;
+    int Level() const override;
+    void SetLevel(int level) override;
+
+    //! Lets the Hold calls return
+    void Open();
+    //! Hold calls waiting for the gate
+    int Holding() const;
+
+private:
+    std::atomic<int> counter_{0};
+    std::atomic<int> level_{7};
+    std::atomic<int> holding_{0};
+    QSemaphore gate_;
+    QMutex stored_mutex_;
+    QList<int> stored_;
+};
+
+//! Time Counter results are cached for
+constexpr int counter_ttl_ms = 200;
+
+#define TEST_SERVICE_API(FUNC, SIG, PROP) \
+    FUNC(int, Echo, (int)) \
+    FUNC(int, Sum, (QList<int>)) \
+    FUNC(QString, Name, (), (const)) \
+    FUNC(int, Counter, (), (cached(counter_ttl_ms), invalidated_by(CounterChanged))) \
+    FUNC(void, Bump, ()) \
+    FUNC(int, Fail, (int)) \
+    FUNC(int, Hold, (int)) \
+    FUNC(void, Store, (int), (oneway)) \
+    FUNC(QList<int>, Stored, ()) \
+    FUNC(Text, Repeat, (Text, int), (compressed)) \
+    FUNC(Samples, Reverse, (Samples), (compressed)) \
+    FUNC(hardbus::Stream<int>, Range, (int)) \
+    FUNC(hardbus::Stream<QByteArray>, Chunks, (int, int)) \
+    FUNC(void, Emit, (int)) \
+    FUNC(void, SetLevel, (int)) \
+    SIG(void, CounterChanged, ()) \
+    SIG(void, Progress, (int), (latest(50))) \
+    SIG(void, Sample, (int), (batched(4, 50))) \
+    PROP(int, Level)
+
+HARDBUS_DEFINE_SERVICE_WITH_PROPERTIES(TestDefinition,
+                                       ITest,
+                                       TEST_SERVICE_API,
+                                       "com.hardbus.Test",
+                                       "/com/hardbus/Test",
+                                       "com.hardbus.Test",
+                                       QDBusConnection::sessionBus())
+
+//! The same objects, one per id
+HARDBUS_DEFINE_SERVICE_WITH_PROPERTIES(TreeDefinition,
+                                       ITest,
+                                       TEST_SERVICE_API,
+                                       "com.hardbus.TestTree",
+                                       "/com/hardbus/TestTree",
+                                       "com.hardbus.Test",
+                                       QDBusConnection::sessionBus())
+
+//! Ids the tree of hardbus_test_server makes objects for
+inline bool IsTreeId(const QString &id)
+{
+    return id.startsWith(QLatin1String("dev"));
+}
+
+//! Objects of the tree of hardbus_test_server are forgotten after this long
+constexpr int tree_idle_timeout_ms = 300;
@@ -0,0 +1,135 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// One access object shared by several threads: blocking calls, asynchronous
+// calls and batches made at the same time each get their own replies
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class ThreadsTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start());
+        remote_ = TestDefinition::CreateServiceInterface(this);
+        QVERIFY(TestDefinition::WaitAndConnectService(remote_, 10000));
+        access_ = qobject_cast<TestDefinition::Access *>(remote_);
+        QVERIFY(access_);
+    }
+
+    void BlockingCallsFromThreads()
+    {
+        // QTest macros are not thread-safe, so the threads only count mismatches
+        std::atomic<int> mismatches{0};
+        RunThreads([&](int thread) {
+            for (int i = 0; i < 200; ++i) {
+                const int v = thread * 1000 + i;
+                if (remote_->Echo(v) != v || remote_->Sum({v, 1}) != v + 1) {
+                    ++mismatches;
+                }
+            }
+        });
+        QCOMPARE(mismatches.load(), 0);
+    }
+
+    void AsynchronousCallsFromThreads()
+    {
+        std::atomic<int> mismatches{0};
+        RunThreads([&](int thread) {
+            std::vector<hardbus::PendingReply<int>> replies;
+            for (int i = 0; i < 200; ++i) {
+                replies.push_back(access_->EchoAsync(thread * 1000 + i));
+            }
+            for (int i = 0; i < 200; ++i) {
+                if (replies[i].Value() != thread * 1000 + i) {
+                    ++mismatches;
+                }
+            }
+        });
+        QCOMPARE(mismatches.load(), 0);
+    }
+
+    void BatchesOfThreadsDoNotMix()
+    {
+        std::atomic<int> mismatches{0};
+        RunThreads([&](int thread) {
+            std::vector<hardbus::PendingReply<int>> replies;
+            {
+                hardbus::Batch<TestDefinition::Access> batch{access_};
+                for (int i = 0; i < 50; ++i) {
+                    replies.push_back(access_->EchoAsync(thread * 1000 + i));
+                }
+                // a blocking call of the batching thread is not recorded
+                if (remote_->Echo(-thread) != -thread) {
+                    ++mismatches;
+                }
+            }
+            for (int i = 0; i < 50; ++i) {
+                if (replies[i].Value() != thread * 1000 + i) {
+                    ++mismatches;
+                }
+            }
+        });
+        QCOMPARE(mismatches.load(), 0);
+    }
+
+    void cleanupTestCase()
+    {
+        delete remote_;
+        server_.Stop();
+    }
+
+private:
+    //! Runs \a f on 8 threads at once and waits for them
+    template<class F>
+    static void RunThreads(F f)
+    {
+        std::vector<std::thread> threads;
+        for (int thread = 0; thread < 8; ++thread) {
+            threads.emplace_back(f, thread);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    PrivateBus bus_;
+    TestServer server_;
+    ITest *remote_ = nullptr;
+    TestDefinition::Access *access_ = nullptr;
+};
+
+QTEST_GUILESS_MAIN(ThreadsTest)
+#include "threads_test.moc"
@@ -0,0 +1,181 @@
+/*
+*    MIT License
+*
+*    Copyright (c) 2019 Zakhar Bondia
+*
+*    Permission is hereby granted, free of charge, to any person obtaining a copy
+*    of this software and associated documentation files (the "Software"), to deal
+*    in the Software without restriction, including without limitation the rights
+*    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+*    copies of the Software, and to permit persons to whom the Software is
+*    furnished to do so, subject to the following conditions:
+*
+*    The above copyright notice and this permission notice shall be included in all
+*    copies or substantial portions of the Software.
+*
+*    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+*    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+*    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+*    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+*    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+*    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+*    SOFTWARE.
+*/
+
+// Service trees: objects are listed, created on their first call, introspected
+// only when they exist and evicted once idle. Calls queued to an object that is
+// deleted before they run fail with UnknownObject
+
+#include "test_bus.h"
+#include "test_service.h"
+
+#include <QtTest>
+
+#include <memory>
+
+//! Exported by the test itself, with objects living in a worker thread
+HARDBUS_DEFINE_SERVICE_WITH_PROPERTIES(LocalTreeDefinition,
+                                       ITest,
+                                       TEST_SERVICE_API,
+                                       "com.hardbus.TestLocalTree",
+                                       "/com/hardbus/TestLocalTree",
+                                       "com.hardbus.Test",
+                                       QDBusConnection::sessionBus())
+
+class TreeTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase()
+    {
+        QVERIFY(bus_.Start());
+        QVERIFY(server_.Start({QStringLiteral("--tree")}));
+        QVERIFY(hardbus::WaitForServiceRegistration<TreeDefinition::TraitsForTreeDefinition>({}, 10000));
+    }
+
+    void ListedObjectsAreReported() { QVERIFY(TreeDefinition::ListServiceObjects().contains(QStringLiteral("dev0"))); }
+
+    void ObjectIsCreatedOnFirstCall()
+    {
+        auto device = Connect(QStringLiteral("dev1"));
+        QCOMPARE(device->Name(), QStringLiteral("dev1"));
+        QCOMPARE(device->Echo(5), 5);
+        QVERIFY(TreeDefinition::ListServiceObjects().contains(QStringLiteral("dev1")));
+    }
+
+    void UnknownObjectFails()
+    {
+        auto device = Connect(QStringLiteral("nope"));
+        auto reply = qobject_cast<TreeDefinition::Access *>(device.get())->NameAsync();
+        reply.WaitForFinished();
+        QVERIFY(reply.IsError());
+        QVERIFY(reply.Error().message().contains(QLatin1String("no object at")));
+        QVERIFY(!TreeDefinition::ListServiceObjects().contains(QStringLiteral("nope")));
+    }
+
+    void OnlyObjectsAreIntrospected()
+    {
+        const auto path = QString{TreeDefinition::ServicePath()} + QStringLiteral("/dev2");
+        const auto declaration
+            = QStringLiteral("interface name=\"%1\"").arg(QLatin1String(TreeDefinition::ServiceInterface()));
+        QVERIFY(Introspect(path).contains(declaration));
+        QVERIFY(!Introspect(path + QStringLiteral("/extra")).contains(declaration));
+    }
+
+    void IdleObjectIsEvicted()
+    {
+        {
+            auto device = Connect(QStringLiteral("dev3"));
+            QCOMPARE(device->Name(), QStringLiteral("dev3"));
+        }
+        QVERIFY(TreeDefinition::ListServiceObjects().contains(QStringLiteral("dev3")));
+        QTRY_VERIFY_WITH_TIMEOUT(!TreeDefinition::ListServiceObjects().contains(QStringLiteral("dev3")),
+                                 tree_idle_timeout_ms * 10);
+        // made again by the next call
+        auto device = Connect(QStringLiteral("dev3"));
+        QCOMPARE(device->Name(), QStringLiteral("dev3"));
+    }
+
+    void CallToDeletedObjectFails()
+    {
+        QThread worker;
+        worker.start();
+        QPointer<TestService> object;
+        hardbus::ObjectTreeOptions<ITest> options;
+        options.factory = [&](const QString &id) -> ITest * {
+            auto made = new TestService{id};
+            made->moveToThread(&worker);
+            object = made;
+            return made;
+        };
+        std::unique_ptr<QObject> tree{LocalTreeDefinition::RegisterServiceTree(options)};
+        auto client = QDBusConnection::connectToBus(QString::fromUtf8(bus_.Address()), QStringLiteral("tree-client"));
+        const auto path = QString{LocalTreeDefinition::ServicePath()} + QStringLiteral("/dev1");
+
+        auto name = Call(client, path, QStringLiteral("Name"));
+        QTRY_VERIFY(name.isFinished());
+        QVERIFY(!name.isError());
+        QVERIFY(object);
+
+        // the worker deletes the object once the call is queued to it
+        QSemaphore gate;
+        TestService *raw = object;
+        QMetaObject::invokeMethod(raw, [&gate, raw] {
+            gate.acquire();
+            delete raw;
+        });
+        auto echo = Call(client, path, QStringLiteral("Echo"), {5});
+        QTest::qWait(200);
+        gate.release();
+        QTRY_VERIFY(echo.isFinished());
+        QCOMPARE(echo.error().type(), QDBusError::UnknownObject);
+
+        tree.reset();
+        QDBusConnection::disconnectFromBus(QStringLiteral("tree-client"));
+        worker.quit();
+        worker.wait();
+    }
+
+    void cleanupTestCase() { server_.Stop(); }
+
+private:
+    //! Access object connected to object \a id of the tree of the server
+    static std::unique_ptr<ITest> Connect(const QString &id)
+    {
+        std::unique_ptr<ITest> device{TreeDefinition::CreateServiceInterface()};
+        if (!TreeDefinition::ConnectServiceObject(device.get(), id, 10000)) {
+            qWarning() << "Cannot connect to" << id;
+        }
+        return device;
+    }
+
+    static QString Introspect(const QString &path)
+    {
+        auto message = QDBusMessage::createMethodCall(TreeDefinition::ServiceName(),
+                                                      path,
+                                                      QStringLiteral("org.freedesktop.DBus.Introspectable"),
+                                                      QStringLiteral("Introspect"));
+        QDBusReply<QString> reply = QDBusConnection::sessionBus().call(message);
+        return reply.value();
+    }
+
+    static QDBusPendingCall Call(const QDBusConnection &client,
+                                 const QString &path,
+                                 const QString &member,
+                                 const QVariantList &arguments = {})
+    {
+        auto message = QDBusMessage::createMethodCall(
+            LocalTreeDefinition::ServiceName(), path, LocalTreeDefinition::ServiceInterface(), member);
+        message.setArguments(arguments);
+        return client.asyncCall(message);
+    }
+
+    PrivateBus bus_;
+    TestServer server_;
+};
+
+QTEST_GUILESS_MAIN(TreeTest)
+#include "tree_test.moc"
+
+HARDBUS_DEFINE_SERVICE_IMPL(LocalTreeDefinition)